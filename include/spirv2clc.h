@@ -15,6 +15,7 @@
 #pragma once
 
 #include <memory>
+#include <set>
 #include <sstream>
 #include <string>
 #include <unordered_map>
@@ -45,6 +46,9 @@ namespace spirv2clc {
 struct translator {
 
   LIBSPIRV2CLC_EXPORT translator(spv_target_env env = SPV_ENV_OPENCL_1_2);
+  // clc_version is the OpenCL C version to generate code for (120, 200 or
+  // 300). It is derived from env when not provided.
+  LIBSPIRV2CLC_EXPORT translator(spv_target_env env, uint32_t clc_version);
 
   LIBSPIRV2CLC_EXPORT translator(translator &&);
   LIBSPIRV2CLC_EXPORT translator &operator=(translator &&);
@@ -54,6 +58,35 @@ struct translator {
                                     std::string *srcout);
   LIBSPIRV2CLC_EXPORT int translate(const std::vector<uint32_t> &binary,
                                     std::string *srcout);
+  // Translates a module held in memory the caller owns, such as a mapped
+  // file, without copying it. count is the number of words.
+  LIBSPIRV2CLC_EXPORT int translate(const uint32_t *words, size_t count,
+                                    std::string *srcout);
+
+  // Opt in to declaring argument arg_index of kernel as a pointer to the
+  // constant address space. Only read-only global buffers whose uses are all
+  // loads are promoted. size is the size of the buffer in bytes, 0 if unknown.
+  LIBSPIRV2CLC_EXPORT void promote_to_constant(const std::string &kernel,
+                                               uint32_t arg_index,
+                                               uint64_t size = 0);
+
+  // Device limits for promoted arguments (CL_DEVICE_MAX_CONSTANT_BUFFER_SIZE
+  // and CL_DEVICE_MAX_CONSTANT_ARGS), 0 means unlimited. When a size limit is
+  // set, only arguments with a known size are promoted.
+  LIBSPIRV2CLC_EXPORT void set_constant_limits(uint64_t max_size,
+                                               uint32_t max_args);
+
+  // Keep scalar conditions used once in the same block as expressions
+  // instead of storing them to temporaries. Enabled by default.
+  LIBSPIRV2CLC_EXPORT void set_inline_conditions(bool enable);
+
+  // Arguments promoted to the constant address space by the last
+  // translation, indexed by kernel name.
+  LIBSPIRV2CLC_EXPORT const std::unordered_map<std::string,
+                                               std::vector<uint32_t>> &
+  constant_args() const {
+    return m_constant_args;
+  }
 
 private:
   uint32_t type_id_for(uint32_t val) const;
@@ -66,6 +99,24 @@ private:
 
   uint32_t array_type_get_length(uint32_t tyid) const;
 
+  const spvtools::opt::analysis::Type *
+  array_type_get_flat_element(uint32_t tyid, uint32_t &length) const;
+
+  uint32_t type_size(uint32_t tyid) const;
+
+  uint32_t type_alignment(uint32_t tyid) const;
+
+  uint32_t access_alignment(const spvtools::opt::Instruction &inst,
+                            uint32_t ptr, uint32_t memops) const;
+
+  bool is_underaligned_vector_access(const spvtools::opt::Instruction &inst,
+                                     uint32_t ptr, uint32_t tyid,
+                                     uint32_t memops) const;
+
+  std::string src_vector_access_pointer(uint32_t ptr, uint32_t tyid) const;
+
+  std::string src_pointer_cast(uint32_t ptr, const std::string &ty) const;
+
   std::string var_for(uint32_t id) const {
     if (m_literals.count(id)) {
       return m_literals.at(id);
@@ -79,6 +130,18 @@ private:
       switch (m_builtin_values.at(id)) {
       case SpvBuiltInWorkDim:
         return src_function_call("get_work_dim");
+      case SpvBuiltInSubgroupSize:
+        return src_function_call("get_sub_group_size");
+      case SpvBuiltInSubgroupMaxSize:
+        return src_function_call("get_max_sub_group_size");
+      case SpvBuiltInNumSubgroups:
+        return src_function_call("get_num_sub_groups");
+      case SpvBuiltInNumEnqueuedSubgroups:
+        return src_function_call("get_enqueued_num_sub_groups");
+      case SpvBuiltInSubgroupId:
+        return src_function_call("get_sub_group_id");
+      case SpvBuiltInSubgroupLocalInvocationId:
+        return src_function_call("get_sub_group_local_id");
       default:
         return "UNIMPLEMENTED";
       }
@@ -87,6 +150,14 @@ private:
     }
   }
 
+  std::string src_initializer(uint32_t id) const {
+    if (m_constant_initializers.count(id)) {
+      return m_constant_initializers.at(id);
+    } else {
+      return var_for(id);
+    }
+  }
+
   std::string src_var_decl(uint32_t tyid, const std::string &name,
                            uint32_t val = 0) const;
 
@@ -95,9 +166,12 @@ private:
     return src_var_decl(tyid, var_for(val), val);
   }
 
-  std::string src_access_chain(const std::string &src_base,
-                               const spvtools::opt::analysis::Type *ty,
-                               uint32_t index) const;
+  std::string src_index(uint32_t index) const;
+
+  bool src_composite_indices(std::string &src,
+                             const spvtools::opt::analysis::Type *ty,
+                             const spvtools::opt::Instruction &inst,
+                             uint32_t first_index) const;
 
   std::string src_vec_comp(uint32_t val, uint32_t comp) const {
     std::stringstream scomp;
@@ -105,15 +179,40 @@ private:
     return var_for(val) + ".s" + scomp.str();
   }
 
+  std::string src_swizzle(uint32_t vec,
+                          const std::vector<uint32_t> &comps) const;
+
+  void src_swizzle_pieces(
+      const std::vector<std::pair<uint32_t, uint32_t>> &comps,
+      std::vector<std::string> &pieces) const;
+
+  std::string src_vector_literal(uint32_t tyid,
+                                 const std::vector<std::string> &pieces) const;
+
+  std::string src_vector_shuffle(const spvtools::opt::Instruction &inst) const;
+
+  std::string
+  src_vector_construct(const spvtools::opt::Instruction &inst) const;
+
   std::string src_as(uint32_t dtyid, const std::string &src) const {
     return "as_" + src_type(dtyid) + "(" + src + ")";
   }
 
   std::string src_as(uint32_t dtyid, uint32_t val) const {
+    if (src_type_for_value(val) == src_type(dtyid)) {
+      return var_for(val);
+    }
     return src_as(dtyid, var_for(val));
   }
 
+  // Reinterpret the result of a signed operation as the unsigned type of
+  // the result. Scalars are converted implicitly when assigned.
+  std::string src_as_result(uint32_t dtyid, const std::string &src) const;
+
   std::string src_as_signed(uint32_t val) const {
+    if (m_signed_literals.count(val)) {
+      return m_signed_literals.at(val);
+    }
     auto varty = type_id_for(val);
     return "as_" + src_type_signed(varty) + "(" + var_for(val) + ")";
   }
@@ -131,6 +230,8 @@ private:
   std::string src_type_for_value(uint32_t idval) const {
     if (m_boolean_src_types.count(idval)) {
       return m_boolean_src_types.at(idval);
+    } else if (m_constant_pointer_types.count(idval)) {
+      return m_constant_pointer_types.at(idval);
     } else {
       return src_type(type_id_for(idval));
     }
@@ -161,6 +262,9 @@ private:
   }
 
   std::string src_cast(uint32_t ty, uint32_t val) const {
+    if (src_type_for_value(val) == src_type(ty)) {
+      return var_for(val);
+    }
     return src_cast(ty, var_for(val));
   }
 
@@ -238,6 +342,18 @@ private:
   std::string make_valid_identifier(const std::string& name) const;
 
   bool get_null_constant(uint32_t tyid, std::string &src) const;
+  bool get_group_prefix(uint32_t scope, std::string &prefix) const;
+  std::string src_mem_fence_flags(uint32_t semantics) const;
+  bool get_memory_order(uint32_t semantics, std::string &order) const;
+  // Memory order for an atomic load (or the failure order of a compare
+  // exchange) or store
+  bool get_access_memory_order(uint32_t semantics, bool load,
+                               std::string &order) const;
+  bool get_memory_scope(uint32_t scope, std::string &src) const;
+  bool get_address_space(uint32_t storage, std::string &src) const;
+  std::string src_atomic_pointer(uint32_t ptr, bool signedty) const;
+  std::string src_subgroup_block_io(const std::string &fn,
+                                    uint32_t tyid) const;
   std::string
   translate_extended_unary(const spvtools::opt::Instruction &inst) const;
   std::string
@@ -246,13 +362,27 @@ private:
   translate_extended_ternary(const spvtools::opt::Instruction &inst) const;
   bool translate_extended_instruction(const spvtools::opt::Instruction &inst,
                                       std::string &src);
+  bool translate_atomic_explicit(const spvtools::opt::Instruction &inst,
+                                 std::string &src) const;
+  bool translate_atomic(const spvtools::opt::Instruction &inst,
+                        std::string &src) const;
+  bool translate_access_chain(const spvtools::opt::Instruction &inst,
+                              std::string &src) const;
+  bool translate_copy_memory(const spvtools::opt::Instruction &inst,
+                             std::string &src) const;
   std::string translate_binop(const spvtools::opt::Instruction &inst) const;
   std::string
   translate_binop_signed(const spvtools::opt::Instruction &inst) const;
+  bool is_inlinable_condition(const spvtools::opt::Instruction &inst) const;
+  bool flatten_selection(const spvtools::opt::Instruction &branch,
+                         uint32_t merge, std::string &src) const;
   bool translate_instruction(const spvtools::opt::Instruction &inst,
                              std::string &src);
 
   bool translate_capabilities();
+  // Finds whether sub-group built-ins are used and the integer element
+  // widths used with the Intel sub-group built-ins.
+  void scan_subgroup_usage(bool &subgroups, std::set<uint32_t> &widths) const;
   bool translate_extensions() const;
   bool translate_extended_instructions_imports() const;
   bool translate_memory_model() const;
@@ -262,9 +392,12 @@ private:
   bool translate_annotations();
   bool translate_type(const spvtools::opt::Instruction &inst);
   bool translate_types_values();
+  bool can_promote_to_constant(uint32_t val,
+                               std::vector<uint32_t> &derived) const;
+  void promote_constant_args(spvtools::opt::Function &func);
   bool translate_function(spvtools::opt::Function &func);
 
-  bool validate_module(const std::vector<uint32_t> &binary) const;
+  bool validate_module(const uint32_t *words, size_t count) const;
   int translate();
 
   void reset() {
@@ -273,9 +406,15 @@ private:
     m_types.clear();
     m_types_signed.clear();
     m_literals.clear();
+    m_signed_literals.clear();
+    m_constant_initializers.clear();
+    m_constant_tables.clear();
     m_entry_points.clear();
     m_entry_points_local_size.clear();
     m_entry_points_contraction_off.clear();
+    m_entry_points_local_size_hint.clear();
+    m_entry_points_vec_type_hint.clear();
+    m_entry_points_subgroup_size.clear();
     m_builtin_variables.clear();
     m_builtin_values.clear();
     m_rounding_mode_decorations.clear();
@@ -286,15 +425,20 @@ private:
     m_volatiles.clear();
     m_packed.clear();
     m_nowrite_params.clear();
+    m_nonwritables.clear();
     m_alignments.clear();
     m_phi_vals.clear();
     m_phi_assigns.clear();
     m_sampled_images.clear();
     m_boolean_src_types.clear();
     m_local_variable_decls.clear();
+    m_constant_pointer_types.clear();
+    m_constant_args.clear();
+    m_branch_hint_macro = false;
   }
 
   spv_target_env m_target_env;
+  uint32_t m_clc_version;
 
   std::unique_ptr<spvtools::opt::IRContext> m_ir;
   std::stringstream m_src;
@@ -302,10 +446,20 @@ private:
   std::unordered_map<uint32_t, std::string> m_types;
   std::unordered_map<uint32_t, std::string> m_types_signed;
   std::unordered_map<uint32_t, std::string> m_literals;
+  std::unordered_map<uint32_t, std::string>
+      m_signed_literals; // value, literal of the signed type
+  std::unordered_map<uint32_t, std::string>
+      m_constant_initializers; // value, initializer list
+  std::unordered_map<std::string, std::string>
+      m_constant_tables; // declaration and initializer, table name
   std::unordered_map<uint32_t, std::string> m_entry_points;
   std::unordered_map<uint32_t, std::tuple<uint32_t, uint32_t, uint32_t>>
       m_entry_points_local_size;
   std::unordered_set<uint32_t> m_entry_points_contraction_off;
+  std::unordered_map<uint32_t, std::tuple<uint32_t, uint32_t, uint32_t>>
+      m_entry_points_local_size_hint;
+  std::unordered_map<uint32_t, std::string> m_entry_points_vec_type_hint;
+  std::unordered_map<uint32_t, uint32_t> m_entry_points_subgroup_size;
   std::unordered_map<uint32_t, SpvBuiltIn> m_builtin_variables;
   std::unordered_map<uint32_t, SpvBuiltIn> m_builtin_values;
   std::unordered_map<uint32_t, SpvFPRoundingMode> m_rounding_mode_decorations;
@@ -316,6 +470,8 @@ private:
   std::unordered_set<uint32_t> m_volatiles;
   std::unordered_set<uint32_t> m_packed;
   std::unordered_set<uint32_t> m_nowrite_params;
+  // NonWritable objects, only used to decide on constant promotion
+  std::unordered_set<uint32_t> m_nonwritables;
   std::unordered_map<uint32_t, uint32_t> m_alignments;
   std::unordered_map<spvtools::opt::Function *, std::vector<uint32_t>>
       m_phi_vals;
@@ -327,6 +483,16 @@ private:
   std::unordered_map<uint32_t, std::string>
       m_boolean_src_types; // value, C type name
   std::unordered_map<uint32_t, std::string> m_local_variable_decls;
+  // kernel name, argument index, size
+  std::unordered_map<std::string, std::unordered_map<uint32_t, uint64_t>>
+      m_constant_promotions;
+  uint64_t m_constant_max_size = 0;
+  uint32_t m_constant_max_args = 0;
+  std::unordered_map<uint32_t, std::string>
+      m_constant_pointer_types; // value, C type name
+  std::unordered_map<std::string, std::vector<uint32_t>> m_constant_args;
+  bool m_branch_hint_macro = false;
+  bool m_inline_conditions = true;
 };
 
 } // namespace spirv2clc
@@ -0,0 +1,884 @@
+// Copyright 2020-2022 The spirv2clc authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Layer that provides clCreateProgramWithIL on top of drivers that only
+// accept OpenCL C. SPIR-V modules are kept as they are until the program is
+// first built, at which point they are translated in process and handed to
+// the driver's clCreateProgramWithSource.
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <dlfcn.h>
+
+#include <spirv-tools/optimizer.hpp>
+
+#define CL_TARGET_OPENCL_VERSION 220
+#include <CL/cl.h>
+#include <CL/cl_ext.h>
+
+#include "spirv2clc.h"
+
+static const uint32_t SPIRV_MAGIC{0x07230203};
+static const std::string IL_EXTENSION{"cl_khr_il_program"};
+static const std::string IL_VERSIONS{"SPIR-V_1.0 SPIR-V_1.1 SPIR-V_1.2"};
+static const size_t TRANSLATION_CACHE_MAX_ENTRIES{64};
+
+static decltype(&clCreateProgramWithSource) fnCreateProgramWithSource;
+static decltype(&clRetainProgram) fnRetainProgram;
+static decltype(&clReleaseProgram) fnReleaseProgram;
+static decltype(&clBuildProgram) fnBuildProgram;
+static decltype(&clCompileProgram) fnCompileProgram;
+static decltype(&clLinkProgram) fnLinkProgram;
+static decltype(&clGetProgramInfo) fnGetProgramInfo;
+static decltype(&clGetProgramBuildInfo) fnGetProgramBuildInfo;
+static decltype(&clCreateKernel) fnCreateKernel;
+static decltype(&clCreateKernelsInProgram) fnCreateKernelsInProgram;
+static decltype(&clGetKernelInfo) fnGetKernelInfo;
+static decltype(&clGetDeviceInfo) fnGetDeviceInfo;
+static decltype(&clGetPlatformInfo) fnGetPlatformInfo;
+static decltype(&clGetExtensionFunctionAddress) fnGetExtensionFunctionAddress;
+static decltype(&clGetExtensionFunctionAddressForPlatform)
+    fnGetExtensionFunctionAddressForPlatform;
+static decltype(&clSetProgramSpecializationConstant)
+    fnSetProgramSpecializationConstant;
+
+static bool gDebug;
+
+static struct init {
+  init() {
+#define LOAD_SYM(X) reinterpret_cast<decltype(&X)>(dlsym(RTLD_NEXT, #X))
+    fnCreateProgramWithSource = LOAD_SYM(clCreateProgramWithSource);
+    fnRetainProgram = LOAD_SYM(clRetainProgram);
+    fnReleaseProgram = LOAD_SYM(clReleaseProgram);
+    fnBuildProgram = LOAD_SYM(clBuildProgram);
+    fnCompileProgram = LOAD_SYM(clCompileProgram);
+    fnLinkProgram = LOAD_SYM(clLinkProgram);
+    fnGetProgramInfo = LOAD_SYM(clGetProgramInfo);
+    fnGetProgramBuildInfo = LOAD_SYM(clGetProgramBuildInfo);
+    fnCreateKernel = LOAD_SYM(clCreateKernel);
+    fnCreateKernelsInProgram = LOAD_SYM(clCreateKernelsInProgram);
+    fnGetKernelInfo = LOAD_SYM(clGetKernelInfo);
+    fnGetDeviceInfo = LOAD_SYM(clGetDeviceInfo);
+    fnGetPlatformInfo = LOAD_SYM(clGetPlatformInfo);
+    fnGetExtensionFunctionAddress = LOAD_SYM(clGetExtensionFunctionAddress);
+    fnGetExtensionFunctionAddressForPlatform =
+        LOAD_SYM(clGetExtensionFunctionAddressForPlatform);
+    fnSetProgramSpecializationConstant =
+        LOAD_SYM(clSetProgramSpecializationConstant);
+#undef LOAD_SYM
+    gDebug = getenv("SPIRV2CLC_LAYER_DEBUG") != nullptr;
+  }
+} gInit;
+
+std::ostream &log() {
+  std::cerr << "[SPIRV2CLC] ";
+  return std::cerr;
+}
+
+// Specialization constant of a module. Booleans are set from a cl_uchar.
+struct spec_constant {
+  size_t size;
+  bool boolean;
+  bool is_signed;
+};
+
+// Finds the specialization constants of a module, by SpecId
+static std::unordered_map<uint32_t, spec_constant>
+find_spec_constants(const std::vector<uint32_t> &il) {
+  std::unordered_map<uint32_t, uint32_t> spec_ids;
+  std::unordered_map<uint32_t, spec_constant> types;
+  std::unordered_map<uint32_t, spec_constant> constants;
+  for (size_t i = 5; i < il.size();) {
+    auto opcode = il[i] & SpvOpCodeMask;
+    auto count = il[i] >> SpvWordCountShift;
+    if ((count == 0) || (i + count > il.size())) {
+      break;
+    }
+    const uint32_t *ops = &il[i + 1];
+    switch (opcode) {
+    case SpvOpDecorate:
+      if ((count == 4) && (ops[1] == SpvDecorationSpecId)) {
+        spec_ids[ops[0]] = ops[2];
+      }
+      break;
+    case SpvOpTypeBool:
+      types[ops[0]] = {sizeof(cl_uchar), true, false};
+      break;
+    case SpvOpTypeInt:
+      types[ops[0]] = {ops[1] / 8, false, ops[2] != 0};
+      break;
+    case SpvOpTypeFloat:
+      types[ops[0]] = {ops[1] / 8, false, false};
+      break;
+    case SpvOpSpecConstantTrue:
+    case SpvOpSpecConstantFalse:
+    case SpvOpSpecConstant:
+      if (spec_ids.count(ops[1]) && types.count(ops[0])) {
+        constants[spec_ids.at(ops[1])] = types.at(ops[0]);
+      }
+      break;
+    }
+    i += count;
+  }
+  return constants;
+}
+
+// Program created from SPIR-V. The handle returned to the application points
+// to one of these, the driver program only exists once the module has been
+// translated.
+struct il_program {
+  il_program(cl_context context, std::vector<uint32_t> &&il)
+      : m_context(context), m_il(std::move(il)), m_refcount(1),
+        m_build_status(CL_BUILD_NONE), m_clc_version(0),
+        m_spec_constants(find_spec_constants(m_il)), m_spec_changed(false) {
+    clRetainContext(m_context);
+  }
+
+  ~il_program() { clReleaseContext(m_context); }
+
+  cl_context context() const { return m_context; }
+  const std::vector<uint32_t> &il() const { return m_il; }
+  std::mutex &lock() { return m_lock; }
+  cl_uint refcount() const { return m_refcount; }
+  void retain() { m_refcount++; }
+  bool release() { return --m_refcount == 0; }
+  cl_build_status build_status() const { return m_build_status; }
+  void set_build_status(cl_build_status status) { m_build_status = status; }
+  const std::string &build_log() const { return m_build_log; }
+  void set_build_log(const std::string &log) { m_build_log = log; }
+  uint32_t clc_version() const { return m_clc_version; }
+  void set_clc_version(uint32_t version) { m_clc_version = version; }
+  const std::unordered_map<uint32_t, spec_constant> &spec_constants() const {
+    return m_spec_constants;
+  }
+  const std::unordered_map<uint32_t, std::vector<uint32_t>> &
+  spec_values() const {
+    return m_spec_values;
+  }
+  void set_spec_value(uint32_t spec_id, std::vector<uint32_t> &&value) {
+    m_spec_values[spec_id] = std::move(value);
+    m_spec_changed = true;
+  }
+  bool spec_changed() const { return m_spec_changed; }
+  void clear_spec_changed() { m_spec_changed = false; }
+
+private:
+  cl_context m_context;
+  std::vector<uint32_t> m_il;
+  std::mutex m_lock;
+  std::atomic<cl_uint> m_refcount;
+  cl_build_status m_build_status;
+  std::string m_build_log;
+  uint32_t m_clc_version;
+  std::unordered_map<uint32_t, spec_constant> m_spec_constants;
+  std::unordered_map<uint32_t, std::vector<uint32_t>> m_spec_values;
+  bool m_spec_changed;
+};
+
+// Maps layer programs to the driver programs created for them, nullptr until
+// the first build.
+static std::mutex gProgramMapLock;
+static std::unordered_map<il_program *, cl_program> gProgramMap;
+
+// Translated sources, keyed by a hash of the module, its size and the OpenCL C
+// version. Applications commonly create the same program once per context or
+// device. Entries keep the module to detect collisions, the oldest entries are
+// evicted first.
+struct translation_cache_entry {
+  std::vector<uint32_t> il;
+  std::string src;
+};
+static std::mutex gTranslationCacheLock;
+static std::unordered_map<std::string, translation_cache_entry>
+    gTranslationCache;
+static std::deque<std::string> gTranslationCacheOrder;
+
+static il_program *find_program(cl_program program, cl_program *real) {
+  auto prog = reinterpret_cast<il_program *>(program);
+  std::lock_guard<std::mutex> lock(gProgramMapLock);
+  auto it = gProgramMap.find(prog);
+  if (it == gProgramMap.end()) {
+    return nullptr;
+  }
+  *real = it->second;
+  return prog;
+}
+
+static cl_int return_info(const void *data, size_t size,
+                          size_t param_value_size, void *param_value,
+                          size_t *param_value_size_ret) {
+  if (param_value != nullptr) {
+    if (param_value_size < size) {
+      return CL_INVALID_VALUE;
+    }
+    memcpy(param_value, data, size);
+  }
+
+  if (param_value_size_ret != nullptr) {
+    *param_value_size_ret = size;
+  }
+
+  return CL_SUCCESS;
+}
+
+static cl_int return_extensions(const std::string &extensions,
+                                size_t param_value_size, void *param_value,
+                                size_t *param_value_size_ret) {
+  std::string exts{extensions.c_str()};
+  if (exts.find(IL_EXTENSION) == std::string::npos) {
+    if (!exts.empty() && (exts.back() != ' ')) {
+      exts += ' ';
+    }
+    exts += IL_EXTENSION;
+  }
+  return return_info(exts.c_str(), exts.size() + 1, param_value_size,
+                     param_value, param_value_size_ret);
+}
+
+cl_program CL_API_CALL clCreateProgramWithIL(cl_context context,
+                                             const void *il, size_t length,
+                                             cl_int *errcode_ret) {
+  cl_int err = CL_SUCCESS;
+  il_program *prog = nullptr;
+
+  if (context == nullptr) {
+    err = CL_INVALID_CONTEXT;
+  } else if ((il == nullptr) || (length < 5 * sizeof(uint32_t)) ||
+             (length % sizeof(uint32_t) != 0)) {
+    err = CL_INVALID_VALUE;
+  } else {
+    std::vector<uint32_t> words(length / sizeof(uint32_t));
+    memcpy(words.data(), il, length);
+    // Keep the module in host byte order
+    if (words[0] == __builtin_bswap32(SPIRV_MAGIC)) {
+      for (auto &word : words) {
+        word = __builtin_bswap32(word);
+      }
+    }
+    if (words[0] != SPIRV_MAGIC) {
+      err = CL_INVALID_VALUE;
+    } else {
+      prog = new il_program(context, std::move(words));
+      std::lock_guard<std::mutex> lock(gProgramMapLock);
+      gProgramMap[prog] = nullptr;
+    }
+  }
+
+  if (errcode_ret != nullptr) {
+    *errcode_ret = err;
+  }
+
+  return reinterpret_cast<cl_program>(prog);
+}
+
+extern "C" cl_program CL_API_CALL clCreateProgramWithILKHR(
+    cl_context context, const void *il, size_t length, cl_int *errcode_ret) {
+  return clCreateProgramWithIL(context, il, length, errcode_ret);
+}
+
+void *CL_API_CALL clGetExtensionFunctionAddress(const char *func_name) {
+  if ((func_name != nullptr) &&
+      !strcmp(func_name, "clCreateProgramWithILKHR")) {
+    return reinterpret_cast<void *>(&clCreateProgramWithILKHR);
+  }
+  return fnGetExtensionFunctionAddress(func_name);
+}
+
+void *CL_API_CALL clGetExtensionFunctionAddressForPlatform(
+    cl_platform_id platform, const char *func_name) {
+  if ((func_name != nullptr) &&
+      !strcmp(func_name, "clCreateProgramWithILKHR")) {
+    return reinterpret_cast<void *>(&clCreateProgramWithILKHR);
+  }
+  return fnGetExtensionFunctionAddressForPlatform(platform, func_name);
+}
+
+cl_int CL_API_CALL clGetPlatformInfo(cl_platform_id platform,
+                                     cl_platform_info param_name,
+                                     size_t param_value_size,
+                                     void *param_value,
+                                     size_t *param_value_size_ret) {
+  if (param_name == CL_PLATFORM_EXTENSIONS) {
+    size_t size;
+    cl_int err = fnGetPlatformInfo(platform, param_name, 0, nullptr, &size);
+    if (err != CL_SUCCESS) {
+      return err;
+    }
+    std::string extensions(size, '\0');
+    err = fnGetPlatformInfo(platform, param_name, size, &extensions[0],
+                            nullptr);
+    if (err != CL_SUCCESS) {
+      return err;
+    }
+    return return_extensions(extensions, param_value_size, param_value,
+                             param_value_size_ret);
+  }
+
+  return fnGetPlatformInfo(platform, param_name, param_value_size,
+                           param_value, param_value_size_ret);
+}
+
+cl_int CL_API_CALL clGetDeviceInfo(cl_device_id device,
+                                   cl_device_info param_name,
+                                   size_t param_value_size, void *param_value,
+                                   size_t *param_value_size_ret) {
+  if (param_name == CL_DEVICE_EXTENSIONS) {
+    size_t size;
+    cl_int err = fnGetDeviceInfo(device, param_name, 0, nullptr, &size);
+    if (err != CL_SUCCESS) {
+      return err;
+    }
+    std::string extensions(size, '\0');
+    err = fnGetDeviceInfo(device, param_name, size, &extensions[0], nullptr);
+    if (err != CL_SUCCESS) {
+      return err;
+    }
+    return return_extensions(extensions, param_value_size, param_value,
+                             param_value_size_ret);
+  }
+
+  if (param_name == CL_DEVICE_IL_VERSION) {
+    // Report the versions the translator accepts unless the driver already
+    // supports some
+    size_t size;
+    cl_int err = fnGetDeviceInfo(device, param_name, 0, nullptr, &size);
+    if ((err != CL_SUCCESS) || (size <= 1)) {
+      return return_info(IL_VERSIONS.c_str(), IL_VERSIONS.size() + 1,
+                         param_value_size, param_value, param_value_size_ret);
+    }
+  }
+
+  return fnGetDeviceInfo(device, param_name, param_value_size, param_value,
+                         param_value_size_ret);
+}
+
+cl_int CL_API_CALL clRetainProgram(cl_program program) {
+  cl_program real;
+  auto prog = find_program(program, &real);
+  if (prog == nullptr) {
+    return fnRetainProgram(program);
+  }
+  prog->retain();
+  return CL_SUCCESS;
+}
+
+cl_int CL_API_CALL clReleaseProgram(cl_program program) {
+  cl_program real;
+  auto prog = find_program(program, &real);
+  if (prog == nullptr) {
+    return fnReleaseProgram(program);
+  }
+  if (!prog->release()) {
+    return CL_SUCCESS;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(gProgramMapLock);
+    real = gProgramMap.at(prog);
+    gProgramMap.erase(prog);
+  }
+  delete prog;
+
+  if (real != nullptr) {
+    return fnReleaseProgram(real);
+  }
+  return CL_SUCCESS;
+}
+
+static spv_target_env target_env(const std::vector<uint32_t> &il) {
+  switch (il[1]) {
+  case 0x00010000:
+    return SPV_ENV_OPENCL_1_2;
+  case 0x00010100:
+    return SPV_ENV_OPENCL_2_1;
+  default:
+    return SPV_ENV_OPENCL_2_2;
+  }
+}
+
+// Picks the OpenCL C version to translate to, the lowest supported by all the
+// devices in the context so that the driver program can be built for any of
+// them. OpenCL C 3.0 makes the 2.0 features optional so 3.0 devices are given
+// 1.2 code.
+static cl_int clc_version(cl_context context, uint32_t *version) {
+  cl_uint num_devices;
+  cl_int err = clGetContextInfo(context, CL_CONTEXT_NUM_DEVICES,
+                                sizeof(num_devices), &num_devices, nullptr);
+  if (err != CL_SUCCESS) {
+    return err;
+  }
+  std::vector<cl_device_id> devices(num_devices);
+  err = clGetContextInfo(context, CL_CONTEXT_DEVICES,
+                         devices.size() * sizeof(cl_device_id), devices.data(),
+                         nullptr);
+  if (err != CL_SUCCESS) {
+    return err;
+  }
+
+  *version = 200;
+  for (auto device : devices) {
+    size_t size;
+    err = fnGetDeviceInfo(device, CL_DEVICE_OPENCL_C_VERSION, 0, nullptr,
+                          &size);
+    if (err != CL_SUCCESS) {
+      return err;
+    }
+    std::string device_version(size, '\0');
+    err = fnGetDeviceInfo(device, CL_DEVICE_OPENCL_C_VERSION, size,
+                          &device_version[0], nullptr);
+    if (err != CL_SUCCESS) {
+      return err;
+    }
+    unsigned major, minor;
+    if ((sscanf(device_version.c_str(), "OpenCL C %u.%u", &major, &minor) !=
+         2) ||
+        (major != 2)) {
+      *version = 120;
+    }
+  }
+
+  return CL_SUCCESS;
+}
+
+static std::string translation_cache_key(const std::vector<uint32_t> &il,
+                                         uint32_t clc_version) {
+  uint64_t hash = 0xcbf29ce484222325ull;
+  auto bytes = reinterpret_cast<const unsigned char *>(il.data());
+  for (size_t i = 0; i < il.size() * sizeof(uint32_t); i++) {
+    hash ^= bytes[i];
+    hash *= 0x100000001b3ull;
+  }
+  char hex[17];
+  snprintf(hex, sizeof(hex), "%016llx", static_cast<unsigned long long>(hash));
+  return std::string(hex) + "-" + std::to_string(il.size()) + "-" +
+         std::to_string(clc_version);
+}
+
+// Applies the values set with clSetProgramSpecializationConstant and freezes
+// all specialization constants, the translator only handles constants.
+static bool specialize(const il_program *prog, std::vector<uint32_t> *il) {
+  spvtools::Optimizer opt(target_env(prog->il()));
+  opt.RegisterPass(
+      spvtools::CreateSetSpecConstantDefaultValuePass(prog->spec_values()));
+  opt.RegisterPass(spvtools::CreateFreezeSpecConstantValuePass());
+  opt.RegisterPass(spvtools::CreateFoldSpecConstantOpAndCompositePass());
+  return opt.Run(prog->il().data(), prog->il().size(), il);
+}
+
+static bool translate(const std::vector<uint32_t> &il, uint32_t clc_version,
+                      std::string *src) {
+  auto key = translation_cache_key(il, clc_version);
+
+  {
+    std::lock_guard<std::mutex> lock(gTranslationCacheLock);
+    auto it = gTranslationCache.find(key);
+    if ((it != gTranslationCache.end()) && (it->second.il == il)) {
+      *src = it->second.src;
+      return true;
+    }
+  }
+
+  spirv2clc::translator translator(target_env(il), clc_version);
+  if (translator.translate(il, src) != 0) {
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lock(gTranslationCacheLock);
+  // A colliding module keeps the existing entry and isn't cached
+  if (gTranslationCache.emplace(key, translation_cache_entry{il, *src})
+          .second) {
+    gTranslationCacheOrder.push_back(std::move(key));
+    if (gTranslationCacheOrder.size() > TRANSLATION_CACHE_MAX_ENTRIES) {
+      gTranslationCache.erase(gTranslationCacheOrder.front());
+      gTranslationCacheOrder.pop_front();
+    }
+  }
+
+  return true;
+}
+
+// Translates the program and creates the driver program for it if that
+// hasn't been done yet. The module is translated for all the devices in the
+// context, so later builds for other devices can reuse the driver program.
+// Changes to specialization constants require a new driver program.
+static cl_int create_program(il_program *prog, cl_program *real) {
+  std::lock_guard<std::mutex> lock(prog->lock());
+  cl_program previous;
+  {
+    std::lock_guard<std::mutex> map_lock(gProgramMapLock);
+    previous = gProgramMap.at(prog);
+  }
+  *real = previous;
+  if ((*real != nullptr) && !prog->spec_changed()) {
+    return CL_SUCCESS;
+  }
+
+  uint32_t version;
+  cl_int err = clc_version(prog->context(), &version);
+  if (err != CL_SUCCESS) {
+    return err;
+  }
+
+  std::vector<uint32_t> specialized;
+  const std::vector<uint32_t> *il = &prog->il();
+  if (!prog->spec_constants().empty()) {
+    if (!specialize(prog, &specialized)) {
+      log() << "Failed to specialize SPIR-V module" << std::endl;
+      prog->set_build_status(CL_BUILD_ERROR);
+      prog->set_build_log("Failed to specialize SPIR-V module");
+      return CL_BUILD_PROGRAM_FAILURE;
+    }
+    il = &specialized;
+  }
+
+  std::string src;
+  if (!translate(*il, version, &src)) {
+    log() << "Failed to translate SPIR-V to OpenCL C" << std::endl;
+    prog->set_build_status(CL_BUILD_ERROR);
+    prog->set_build_log("Failed to translate SPIR-V to OpenCL C");
+    return CL_BUILD_PROGRAM_FAILURE;
+  }
+  if (gDebug) {
+    log() << "Translated program " << prog << " to OpenCL C " << version / 100
+          << "." << version % 100 / 10 << ":" << std::endl
+          << src << std::endl;
+  }
+
+  const char *csrc = src.c_str();
+  *real = fnCreateProgramWithSource(prog->context(), 1, &csrc, nullptr, &err);
+  if (err != CL_SUCCESS) {
+    return err;
+  }
+  prog->set_clc_version(version);
+  prog->clear_spec_changed();
+
+  {
+    std::lock_guard<std::mutex> map_lock(gProgramMapLock);
+    gProgramMap[prog] = *real;
+  }
+
+  // Kernels created from the previous driver program keep it alive
+  if (previous != nullptr) {
+    fnReleaseProgram(previous);
+  }
+
+  return CL_SUCCESS;
+}
+
+static std::string build_options(il_program *prog, const char *options) {
+  std::string soptions;
+  if (options != nullptr) {
+    soptions += options;
+  }
+  if ((prog->clc_version() >= 200) &&
+      (soptions.find("-cl-std=") == std::string::npos)) {
+    soptions += " -cl-std=CL2.0";
+  }
+  return soptions;
+}
+
+cl_int CL_API_CALL clBuildProgram(
+    cl_program program, cl_uint num_devices, const cl_device_id *device_list,
+    const char *options,
+    void(CL_CALLBACK *pfn_notify)(cl_program program, void *user_data),
+    void *user_data) {
+  cl_program real;
+  auto prog = find_program(program, &real);
+  if (prog == nullptr) {
+    return fnBuildProgram(program, num_devices, device_list, options,
+                          pfn_notify, user_data);
+  }
+
+  cl_int ret = create_program(prog, &real);
+  if (ret == CL_SUCCESS) {
+    auto soptions = build_options(prog, options);
+    ret = fnBuildProgram(real, num_devices, device_list, soptions.c_str(),
+                         nullptr, nullptr);
+  }
+
+  if (pfn_notify != nullptr) {
+    pfn_notify(program, user_data);
+  }
+
+  return ret;
+}
+
+cl_int CL_API_CALL clCompileProgram(
+    cl_program program, cl_uint num_devices, const cl_device_id *device_list,
+    const char *options, cl_uint num_input_headers,
+    const cl_program *input_headers, const char **header_include_names,
+    void(CL_CALLBACK *pfn_notify)(cl_program program, void *user_data),
+    void *user_data) {
+  cl_program real;
+  auto prog = find_program(program, &real);
+  if (prog == nullptr) {
+    return fnCompileProgram(program, num_devices, device_list, options,
+                            num_input_headers, input_headers,
+                            header_include_names, pfn_notify, user_data);
+  }
+
+  // Headers are ignored for programs created from IL
+  cl_int ret = create_program(prog, &real);
+  if (ret == CL_BUILD_PROGRAM_FAILURE) {
+    ret = CL_COMPILE_PROGRAM_FAILURE;
+  } else if (ret == CL_SUCCESS) {
+    auto soptions = build_options(prog, options);
+    ret = fnCompileProgram(real, num_devices, device_list, soptions.c_str(), 0,
+                           nullptr, nullptr, nullptr, nullptr);
+  }
+
+  if (pfn_notify != nullptr) {
+    pfn_notify(program, user_data);
+  }
+
+  return ret;
+}
+
+cl_program CL_API_CALL clLinkProgram(
+    cl_context context, cl_uint num_devices, const cl_device_id *device_list,
+    const char *options, cl_uint num_input_programs,
+    const cl_program *input_programs,
+    void(CL_CALLBACK *pfn_notify)(cl_program program, void *user_data),
+    void *user_data, cl_int *errcode_ret) {
+  std::vector<cl_program> input_progs;
+  for (cl_uint i = 0; i < num_input_programs; i++) {
+    cl_program real;
+    if (find_program(input_programs[i], &real) == nullptr) {
+      real = input_programs[i];
+    } else if (real == nullptr) {
+      // Not compiled
+      if (errcode_ret != nullptr) {
+        *errcode_ret = CL_INVALID_OPERATION;
+      }
+      return nullptr;
+    }
+    input_progs.push_back(real);
+  }
+
+  return fnLinkProgram(context, num_devices, device_list, options,
+                       num_input_programs, input_progs.data(), pfn_notify,
+                       user_data, errcode_ret);
+}
+
+cl_int CL_API_CALL clSetProgramSpecializationConstant(cl_program program,
+                                                      cl_uint spec_id,
+                                                      size_t spec_size,
+                                                      const void *spec_value) {
+  cl_program real;
+  auto prog = find_program(program, &real);
+  if (prog == nullptr) {
+    return fnSetProgramSpecializationConstant(program, spec_id, spec_size,
+                                              spec_value);
+  }
+
+  // Values are applied when the program is next built
+  auto constant = prog->spec_constants().find(spec_id);
+  if (constant == prog->spec_constants().end()) {
+    return CL_INVALID_SPEC_ID;
+  }
+  auto &spec = constant->second;
+  if ((spec_value == nullptr) || (spec_size != spec.size)) {
+    return CL_INVALID_VALUE;
+  }
+
+  // Values narrower than a word are sign or zero extended to a word
+  std::vector<uint32_t> value((spec_size + 3) / 4, 0);
+  memcpy(value.data(), spec_value, spec_size);
+  if (spec.boolean) {
+    value[0] = value[0] != 0;
+  } else if (spec.is_signed && (spec_size < sizeof(uint32_t))) {
+    auto shift = 32 - 8 * spec_size;
+    value[0] = static_cast<uint32_t>(static_cast<int32_t>(value[0] << shift) >>
+                                     shift);
+  }
+
+  std::lock_guard<std::mutex> lock(prog->lock());
+  prog->set_spec_value(spec_id, std::move(value));
+  return CL_SUCCESS;
+}
+
+cl_int CL_API_CALL clGetProgramInfo(cl_program program,
+                                    cl_program_info param_name,
+                                    size_t param_value_size, void *param_value,
+                                    size_t *param_value_size_ret) {
+  cl_program real;
+  auto prog = find_program(program, &real);
+  if (prog == nullptr) {
+    return fnGetProgramInfo(program, param_name, param_value_size,
+                            param_value, param_value_size_ret);
+  }
+
+  // Properties of the program as the application created it
+  switch (param_name) {
+  case CL_PROGRAM_IL:
+    return return_info(prog->il().data(),
+                       prog->il().size() * sizeof(uint32_t), param_value_size,
+                       param_value, param_value_size_ret);
+  case CL_PROGRAM_SOURCE:
+    return return_info("", 1, param_value_size, param_value,
+                       param_value_size_ret);
+  case CL_PROGRAM_REFERENCE_COUNT: {
+    cl_uint val_uint = prog->refcount();
+    return return_info(&val_uint, sizeof(val_uint), param_value_size,
+                       param_value, param_value_size_ret);
+  }
+  case CL_PROGRAM_CONTEXT: {
+    cl_context val_context = prog->context();
+    return return_info(&val_context, sizeof(val_context), param_value_size,
+                       param_value, param_value_size_ret);
+  }
+  }
+
+  if (real != nullptr) {
+    return fnGetProgramInfo(real, param_name, param_value_size, param_value,
+                            param_value_size_ret);
+  }
+
+  cl_int ret;
+  cl_uint val_uint;
+  std::vector<cl_device_id> val_devices;
+
+  switch (param_name) {
+  case CL_PROGRAM_NUM_DEVICES:
+    ret = clGetContextInfo(prog->context(), CL_CONTEXT_NUM_DEVICES,
+                           sizeof(val_uint), &val_uint, nullptr);
+    if (ret != CL_SUCCESS) {
+      return ret;
+    }
+    return return_info(&val_uint, sizeof(val_uint), param_value_size,
+                       param_value, param_value_size_ret);
+  case CL_PROGRAM_DEVICES:
+    ret = clGetContextInfo(prog->context(), CL_CONTEXT_NUM_DEVICES,
+                           sizeof(val_uint), &val_uint, nullptr);
+    if (ret != CL_SUCCESS) {
+      return ret;
+    }
+    val_devices.resize(val_uint);
+    ret = clGetContextInfo(prog->context(), CL_CONTEXT_DEVICES,
+                           val_devices.size() * sizeof(cl_device_id),
+                           val_devices.data(), nullptr);
+    if (ret != CL_SUCCESS) {
+      return ret;
+    }
+    return return_info(val_devices.data(),
+                       val_devices.size() * sizeof(cl_device_id),
+                       param_value_size, param_value, param_value_size_ret);
+  case CL_PROGRAM_NUM_KERNELS:
+  case CL_PROGRAM_KERNEL_NAMES:
+    return CL_INVALID_PROGRAM_EXECUTABLE;
+  default:
+    return CL_INVALID_VALUE;
+  }
+}
+
+cl_int CL_API_CALL clGetProgramBuildInfo(
+    cl_program program, cl_device_id device, cl_program_build_info param_name,
+    size_t param_value_size, void *param_value, size_t *param_value_size_ret) {
+  cl_program real;
+  auto prog = find_program(program, &real);
+  if (prog == nullptr) {
+    return fnGetProgramBuildInfo(program, device, param_name,
+                                 param_value_size, param_value,
+                                 param_value_size_ret);
+  }
+
+  if (real != nullptr) {
+    return fnGetProgramBuildInfo(real, device, param_name, param_value_size,
+                                 param_value, param_value_size_ret);
+  }
+
+  switch (param_name) {
+  case CL_PROGRAM_BUILD_STATUS: {
+    cl_build_status val_build_status = prog->build_status();
+    return return_info(&val_build_status, sizeof(val_build_status),
+                       param_value_size, param_value, param_value_size_ret);
+  }
+  case CL_PROGRAM_BUILD_OPTIONS:
+    return return_info("", 1, param_value_size, param_value,
+                       param_value_size_ret);
+  case CL_PROGRAM_BUILD_LOG:
+    return return_info(prog->build_log().c_str(), prog->build_log().size() + 1,
+                       param_value_size, param_value, param_value_size_ret);
+  case CL_PROGRAM_BINARY_TYPE: {
+    cl_program_binary_type val_binary_type = CL_PROGRAM_BINARY_TYPE_NONE;
+    return return_info(&val_binary_type, sizeof(val_binary_type),
+                       param_value_size, param_value, param_value_size_ret);
+  }
+  default:
+    return CL_INVALID_VALUE;
+  }
+}
+
+cl_kernel CL_API_CALL clCreateKernel(cl_program program,
+                                     const char *kernel_name,
+                                     cl_int *errcode_ret) {
+  cl_program real;
+  if (find_program(program, &real) == nullptr) {
+    real = program;
+  } else if (real == nullptr) {
+    if (errcode_ret != nullptr) {
+      *errcode_ret = CL_INVALID_PROGRAM_EXECUTABLE;
+    }
+    return nullptr;
+  }
+
+  return fnCreateKernel(real, kernel_name, errcode_ret);
+}
+
+cl_int CL_API_CALL clCreateKernelsInProgram(cl_program program,
+                                            cl_uint num_kernels,
+                                            cl_kernel *kernels,
+                                            cl_uint *num_kernels_ret) {
+  cl_program real;
+  if (find_program(program, &real) == nullptr) {
+    real = program;
+  } else if (real == nullptr) {
+    return CL_INVALID_PROGRAM_EXECUTABLE;
+  }
+
+  return fnCreateKernelsInProgram(real, num_kernels, kernels,
+                                  num_kernels_ret);
+}
+
+cl_int CL_API_CALL clGetKernelInfo(cl_kernel kernel, cl_kernel_info param_name,
+                                   size_t param_value_size, void *param_value,
+                                   size_t *param_value_size_ret) {
+  cl_int err = fnGetKernelInfo(kernel, param_name, param_value_size,
+                               param_value, param_value_size_ret);
+
+  // Return the handle the application knows the program by
+  if ((err == CL_SUCCESS) && (param_name == CL_KERNEL_PROGRAM) &&
+      (param_value != nullptr)) {
+    cl_program kprog;
+    memcpy(&kprog, param_value, sizeof(kprog));
+    std::lock_guard<std::mutex> lock(gProgramMapLock);
+    for (auto &layer_real : gProgramMap) {
+      if (kprog == layer_real.second) {
+        memcpy(param_value, &layer_real.first, sizeof(cl_program));
+        break;
+      }
+    }
+  }
+
+  return err;
+}
@@ -14,6 +14,9 @@
 
 #include "spirv2clc.h"
 
+#include <algorithm>
+#include <limits>
+
 #define CL_TARGET_OPENCL_VERSION 120
 #include "CL/cl_half.h"
 
@@ -48,6 +51,108 @@ std::string rounding_mode(SpvFPRoundingMode mode) {
   return "UNKNOWN ROUNDING MODE";
 }
 
+// Decode the Vector Type operand of the VecTypeHint execution mode. The 16
+// low-order bits select the component type and the 16 high-order bits give
+// the number of components.
+std::string vec_type_hint(uint32_t hint) {
+  static const char *component_types[] = {"char", "short", "int",   "long",
+                                          "half", "float", "double"};
+  auto ctype = hint & 0xFFFF;
+  auto ncomp = hint >> 16;
+  if (ctype >= sizeof(component_types) / sizeof(component_types[0])) {
+    return "";
+  }
+  std::string ret = component_types[ctype];
+  switch (ncomp) {
+  case 0:
+  case 1:
+    break;
+  case 2:
+  case 3:
+  case 4:
+  case 8:
+  case 16:
+    ret += std::to_string(ncomp);
+    break;
+  default:
+    return "";
+  }
+  return ret;
+}
+
+const uint32_t gMemorySemanticsOrderingMask =
+    SpvMemorySemanticsAcquireMask | SpvMemorySemanticsReleaseMask |
+    SpvMemorySemanticsAcquireReleaseMask |
+    SpvMemorySemanticsSequentiallyConsistentMask;
+
+// Size in bytes from which composite constants are emitted as program-scope
+// tables
+const uint32_t gConstantTableMinSize = 64;
+
+// Instructions that compute scalar conditions without side effects
+const std::unordered_set<spv::Op> gConditionOpcodes = {
+    spv::Op::OpIEqual,
+    spv::Op::OpINotEqual,
+    spv::Op::OpUGreaterThan,
+    spv::Op::OpSGreaterThan,
+    spv::Op::OpUGreaterThanEqual,
+    spv::Op::OpSGreaterThanEqual,
+    spv::Op::OpULessThan,
+    spv::Op::OpSLessThan,
+    spv::Op::OpULessThanEqual,
+    spv::Op::OpSLessThanEqual,
+    spv::Op::OpFOrdEqual,
+    spv::Op::OpFUnordEqual,
+    spv::Op::OpFOrdNotEqual,
+    spv::Op::OpFUnordNotEqual,
+    spv::Op::OpFOrdLessThan,
+    spv::Op::OpFUnordLessThan,
+    spv::Op::OpFOrdGreaterThan,
+    spv::Op::OpFUnordGreaterThan,
+    spv::Op::OpFOrdLessThanEqual,
+    spv::Op::OpFUnordLessThanEqual,
+    spv::Op::OpFOrdGreaterThanEqual,
+    spv::Op::OpFUnordGreaterThanEqual,
+    spv::Op::OpLessOrGreater,
+    spv::Op::OpOrdered,
+    spv::Op::OpUnordered,
+    spv::Op::OpIsNan,
+    spv::Op::OpIsInf,
+    spv::Op::OpIsFinite,
+    spv::Op::OpIsNormal,
+    spv::Op::OpSignBitSet,
+    spv::Op::OpAny,
+    spv::Op::OpAll,
+    spv::Op::OpLogicalEqual,
+    spv::Op::OpLogicalNotEqual,
+    spv::Op::OpLogicalOr,
+    spv::Op::OpLogicalAnd,
+    spv::Op::OpLogicalNot,
+    spv::Op::OpSelect,
+};
+
+// Maximum number of element copies OpCopyMemory* is unrolled to
+const uint64_t gCopyMemoryMaxUnroll = 8;
+
+// Types used to copy memory in chunks of a given width in bytes
+const std::unordered_map<uint32_t, std::string> gCopyMemoryChunkTypes = {
+    {1, "uchar"}, {2, "ushort"}, {4, "uint"}, {8, "ulong"}, {16, "uint4"},
+};
+
+uint32_t default_clc_version(spv_target_env env) {
+  switch (env) {
+  case SPV_ENV_OPENCL_2_0:
+  case SPV_ENV_OPENCL_EMBEDDED_2_0:
+  case SPV_ENV_OPENCL_2_1:
+  case SPV_ENV_OPENCL_EMBEDDED_2_1:
+  case SPV_ENV_OPENCL_2_2:
+  case SPV_ENV_OPENCL_EMBEDDED_2_2:
+    return 200;
+  default:
+    return 120;
+  }
+}
+
 const spvtools::MessageConsumer spvtools_message_consumer =
     [](spv_message_level_t level, const char *, const spv_position_t &position,
        const char *message) {
@@ -80,12 +185,30 @@ const spvtools::MessageConsumer spvtools_message_consumer =
 
 namespace spirv2clc {
 
-translator::translator(spv_target_env env) : m_target_env(env) {}
+translator::translator(spv_target_env env)
+    : m_target_env(env), m_clc_version(default_clc_version(env)) {}
+
+translator::translator(spv_target_env env, uint32_t clc_version)
+    : m_target_env(env), m_clc_version(clc_version) {}
 
 translator::~translator() = default;
 translator::translator(translator &&) = default;
 translator &translator::operator=(translator &&) = default;
 
+void translator::promote_to_constant(const std::string &kernel,
+                                     uint32_t arg_index, uint64_t size) {
+  m_constant_promotions[kernel][arg_index] = size;
+}
+
+void translator::set_inline_conditions(bool enable) {
+  m_inline_conditions = enable;
+}
+
+void translator::set_constant_limits(uint64_t max_size, uint32_t max_args) {
+  m_constant_max_size = max_size;
+  m_constant_max_args = max_args;
+}
+
 uint32_t translator::type_id_for(uint32_t val) const {
   auto defuse = m_ir->get_def_use_mgr();
   return defuse->GetDef(val)->type_id();
@@ -127,15 +250,85 @@ uint32_t translator::array_type_get_length(uint32_t tyid) const {
   return length_info.words[1];
 }
 
+const Type *translator::array_type_get_flat_element(uint32_t tyid,
+                                                    uint32_t &length) const {
+  // Nested arrays are flattened to a single array of their innermost element
+  const Type *type = type_for(tyid);
+  length = 1;
+  while (type->kind() == Type::Kind::kArray) {
+    length *= array_type_get_length(type_id_for(type));
+    type = type->AsArray()->element_type();
+  }
+  return type;
+}
+
+uint32_t translator::type_alignment(uint32_t tyid) const {
+  auto type = type_for(tyid);
+  switch (type->kind()) {
+  case Type::Kind::kArray:
+    return type_alignment(type_id_for(type->AsArray()->element_type()));
+  case Type::Kind::kStruct: {
+    if (m_packed.count(tyid)) {
+      return 1;
+    }
+    uint32_t align = 1;
+    for (auto mty : type->AsStruct()->element_types()) {
+      align = std::max(align, type_alignment(type_id_for(mty)));
+    }
+    return align;
+  }
+  default:
+    return type_size(tyid);
+  }
+}
+
+uint32_t translator::type_size(uint32_t tyid) const {
+  auto type = type_for(tyid);
+  switch (type->kind()) {
+  case Type::Kind::kBool:
+    return 1;
+  case Type::Kind::kInteger:
+    return type->AsInteger()->width() / 8;
+  case Type::Kind::kFloat:
+    return type->AsFloat()->width() / 8;
+  case Type::Kind::kVector: {
+    // 3-component vectors have the size of 4-component vectors
+    auto vty = type->AsVector();
+    auto ncomp = vty->element_count() == 3 ? 4 : vty->element_count();
+    return ncomp * type_size(type_id_for(vty->element_type()));
+  }
+  case Type::Kind::kPointer: {
+    auto addressing = m_ir->module()->GetMemoryModel()->GetSingleWordOperand(0);
+    return addressing == SpvAddressingModelPhysical64 ? 8 : 4;
+  }
+  case Type::Kind::kArray:
+    return array_type_get_length(tyid) *
+           type_size(type_id_for(type->AsArray()->element_type()));
+  case Type::Kind::kStruct: {
+    bool packed = m_packed.count(tyid) != 0;
+    uint32_t size = 0;
+    for (auto mty : type->AsStruct()->element_types()) {
+      auto mtyid = type_id_for(mty);
+      if (!packed) {
+        auto align = type_alignment(mtyid);
+        size = (size + align - 1) / align * align;
+      }
+      size += type_size(mtyid);
+    }
+    auto align = type_alignment(tyid);
+    return (size + align - 1) / align * align;
+  }
+  default:
+    return 0;
+  }
+}
+
 std::string translator::src_var_decl(uint32_t tyid, const std::string &name,
                                      uint32_t val) const {
   auto ty = type_for(tyid);
   if (ty->kind() == spvtools::opt::analysis::Type::Kind::kArray) {
-    auto aty = ty->AsArray();
-    auto eid = type_id_for(aty->element_type());
-    auto cstmgr = m_ir->get_constant_mgr();
-    auto ecnt =
-        cstmgr->FindDeclaredConstant(aty->LengthId())->GetSignExtendedValue();
+    uint32_t ecnt;
+    auto eid = type_id_for(array_type_get_flat_element(tyid, ecnt));
     return src_type(eid) + " " + name + "[" + std::to_string(ecnt) + "]";
   } else {
     if (val != 0) {
@@ -146,34 +339,256 @@ std::string translator::src_var_decl(uint32_t tyid, const std::string &name,
   }
 }
 
-std::string
-translator::src_access_chain(const std::string &src_base,
-                             const spvtools::opt::analysis::Type *ty,
-                             uint32_t index) const {
-  std::string ret = "(" + src_base + ")";
-  if (ty->kind() == spvtools::opt::analysis::Type::kStruct) {
-    auto cstmgr = m_ir->get_constant_mgr();
-    auto idxcst = cstmgr->FindDeclaredConstant(index);
-    if (idxcst == nullptr) {
-      return "UNIMPLEMENTED";
+std::string translator::src_index(uint32_t index) const {
+  auto cst = m_ir->get_constant_mgr()->FindDeclaredConstant(index);
+  if (cst != nullptr) {
+    return std::to_string(cst->GetSignExtendedValue());
+  }
+  // Indices are signed
+  return src_as_signed(index);
+}
+
+bool translator::translate_access_chain(const Instruction &inst,
+                                        std::string &src) const {
+  auto opcode = inst.opcode();
+  auto rtype = inst.type_id();
+  auto base = inst.GetSingleWordOperand(2);
+  bool ptr_chain = (opcode == spv::Op::OpPtrAccessChain) ||
+                   (opcode == spv::Op::OpInBoundsPtrAccessChain);
+  auto cstmgr = m_ir->get_constant_mgr();
+
+  // Build a single lvalue expression for the whole chain. Pointers to arrays
+  // are pointers to their first element so an array is represented by an
+  // expression that decays to such a pointer plus a pending element offset.
+  // Nested arrays are flattened and only contribute to that offset.
+  const Type *cty = type_for_val(base)->AsPointer()->pointee_type();
+  std::string lval;
+  std::string offset;
+  auto add_offset = [&](uint32_t idx, const Type *elemty) {
+    uint32_t len;
+    array_type_get_flat_element(type_id_for(elemty), len);
+    std::string term;
+    auto idxcst = cstmgr->FindDeclaredConstant(idx);
+    if (idxcst != nullptr) {
+      auto cstoffset = idxcst->GetSignExtendedValue() * len;
+      if (cstoffset == 0) {
+        return;
+      }
+      term = std::to_string(cstoffset);
+    } else {
+      term = src_index(idx) + " * " + std::to_string(len);
     }
-    return "&(" + ret + "->m" + std::to_string(idxcst->GetZeroExtendedValue()) +
-           ")";
-  } else if (ty->kind() == spvtools::opt::analysis::Type::kArray) {
-    return "&(" + ret + "[" + var_for(index) + "])";
+    offset = offset.empty() ? term : offset + " + " + term;
+  };
+  unsigned first_index = 3;
+  if (ptr_chain) {
+    auto elem = inst.GetSingleWordOperand(3);
+    first_index = 4;
+    if (cty->kind() == Type::Kind::kArray) {
+      lval = var_for(base);
+      add_offset(elem, cty);
+    } else {
+      lval = var_for(base) + "[" + src_index(elem) + "]";
+    }
+  } else if (cty->kind() == Type::Kind::kArray) {
+    lval = var_for(base);
+  } else {
+    lval = "(*" + var_for(base) + ")";
+  }
+
+  for (unsigned i = first_index; i < inst.NumOperands(); i++) {
+    auto idx = inst.GetSingleWordOperand(i);
+    switch (cty->kind()) {
+    case Type::Kind::kStruct: {
+      auto idxcst = cstmgr->FindDeclaredConstant(idx);
+      if (idxcst == nullptr) {
+        std::cerr << "UNIMPLEMENTED non-constant structure index" << std::endl;
+        return false;
+      }
+      auto member = idxcst->GetZeroExtendedValue();
+      lval += ".m" + std::to_string(member);
+      cty = cty->AsStruct()->element_types()[member];
+      break;
+    }
+    case Type::Kind::kArray: {
+      auto elemty = cty->AsArray()->element_type();
+      if (elemty->kind() == Type::Kind::kArray) {
+        add_offset(idx, elemty);
+        cty = elemty;
+        break;
+      }
+      auto sidx = src_index(idx);
+      if (!offset.empty()) {
+        sidx = offset + " + " + sidx;
+        offset.clear();
+      }
+      lval += "[" + sidx + "]";
+      cty = elemty;
+      break;
+    }
+    case Type::Kind::kVector: {
+      // Vector components aren't addressable, index the vector as an array
+      auto storage = type_for(rtype)->AsPointer()->storage_class();
+      auto elemty = cty->AsVector()->element_type();
+      auto elemptrty = src_pointer_type(static_cast<uint32_t>(storage),
+                                        type_id_for(elemty), false);
+      if (m_constant_pointer_types.count(inst.result_id())) {
+        elemptrty = m_constant_pointer_types.at(inst.result_id());
+      }
+      lval = "((" + elemptrty + ")&" + lval + ")[" + src_index(idx) + "]";
+      cty = elemty;
+      break;
+    }
+    default:
+      std::cerr << "UNIMPLEMENTED access chain type " << cty->kind()
+                << std::endl;
+      return false;
+    }
+  }
+
+  if (cty->kind() == Type::Kind::kArray) {
+    src = "&" + lval + "[" + (offset.empty() ? "0" : offset) + "]";
   } else {
+    src = "&" + lval;
+  }
+  return true;
+}
+
+bool translator::src_composite_indices(std::string &src,
+                                       const spvtools::opt::analysis::Type *ty,
+                                       const Instruction &inst,
+                                       uint32_t first_index) const {
+  uint32_t offset = 0;
+  bool nested = false;
+  for (unsigned i = first_index; i < inst.NumOperands(); i++) {
+    auto idx = inst.GetSingleWordOperand(i);
+    switch (ty->kind()) {
+    case Type::Kind::kVector: {
+      std::stringstream scomp;
+      scomp << std::hex << idx;
+      src += ".s" + scomp.str();
+      ty = ty->AsVector()->element_type();
+      break;
+    }
+    case Type::Kind::kStruct:
+      src += ".m" + std::to_string(idx);
+      ty = ty->AsStruct()->element_types()[idx];
+      break;
+    case Type::Kind::kArray: {
+      // Nested arrays are flattened
+      auto elemty = ty->AsArray()->element_type();
+      uint32_t len;
+      array_type_get_flat_element(type_id_for(elemty), len);
+      offset += idx * len;
+      nested = elemty->kind() == Type::Kind::kArray;
+      if (!nested) {
+        src += "[" + std::to_string(offset) + "]";
+        offset = 0;
+      }
+      ty = elemty;
+      break;
+    }
+    default:
+      std::cerr << "UNIMPLEMENTED composite index into type " << ty->kind()
+                << std::endl;
+      return false;
+    }
+  }
+  if (nested) {
+    std::cerr << "UNIMPLEMENTED composite index into a nested array"
+              << std::endl;
+    return false;
+  }
+  return true;
+}
+
+uint32_t translator::access_alignment(const Instruction &inst, uint32_t ptr,
+                                      uint32_t memops) const {
+  if (inst.NumOperands() > memops) {
+    auto mask = inst.GetSingleWordOperand(memops);
+    if (mask & SpvMemoryAccessAlignedMask) {
+      return inst.GetSingleWordOperand(memops + 1);
+    }
+  }
+
+  if (m_alignments.count(ptr)) {
+    return m_alignments.at(ptr);
+  }
+
+  // Members of packed structures have no alignment guarantees
+  auto def = m_ir->get_def_use_mgr()->GetDef(ptr);
+  switch (def->opcode()) {
+  case spv::Op::OpAccessChain:
+  case spv::Op::OpInBoundsAccessChain:
+  case spv::Op::OpPtrAccessChain:
+  case spv::Op::OpInBoundsPtrAccessChain: {
+    auto base = def->GetSingleWordOperand(2);
+    auto baseptrty = type_for_val(base)->AsPointer();
+    if (m_packed.count(type_id_for(baseptrty->pointee_type()))) {
+      return 1;
+    }
+    break;
+  }
+  default:
+    break;
+  }
+
+  return 0;
+}
+
+bool translator::is_underaligned_vector_access(const Instruction &inst,
+                                               uint32_t ptr, uint32_t tyid,
+                                               uint32_t memops) const {
+  auto vecty = type_for(tyid)->AsVector();
+  if ((vecty == nullptr) || m_volatiles.count(ptr)) {
+    return false;
+  }
+
+  if ((inst.NumOperands() > memops) &&
+      (inst.GetSingleWordOperand(memops) & SpvMemoryAccessVolatileMask)) {
+    return false;
+  }
+
+  auto align = access_alignment(inst, ptr, memops);
+  return (align != 0) && (align < type_alignment(tyid));
+}
+
+std::string translator::src_vector_access_pointer(uint32_t ptr,
+                                                  uint32_t tyid) const {
+  auto ptrty = type_for_val(ptr)->AsPointer();
+  auto storage = static_cast<uint32_t>(ptrty->storage_class());
+  if (m_constant_pointer_types.count(ptr)) {
+    storage = SpvStorageClassUniformConstant;
+  }
+  auto elemty = type_id_for(type_for(tyid)->AsVector()->element_type());
+  return "((" + src_pointer_type(storage, elemty, false) + ")" + var_for(ptr) +
+         ")";
+}
+
+std::string translator::src_pointer_cast(uint32_t ptr,
+                                         const std::string &ty) const {
+  auto ptrty = type_for_val(ptr)->AsPointer();
+  auto storage = static_cast<uint32_t>(ptrty->storage_class());
+  if (m_constant_pointer_types.count(ptr)) {
+    storage = SpvStorageClassUniformConstant;
+  }
+  std::string addrspace;
+  if (!get_address_space(storage, addrspace)) {
     return "UNIMPLEMENTED";
   }
+  return "((" + ty + " " + addrspace + "*)" + var_for(ptr) + ")";
 }
 
 std::string
 translator::src_type_memory_object_declaration(uint32_t tid, uint32_t val,
                                                const std::string &name) const {
   std::string ret;
+  uint32_t len = 0;
   if (type_for(tid)->kind() == Type::Kind::kArray) {
-    auto tarray = type_for(tid)->AsArray();
-    auto elemty = tarray->element_type();
+    auto elemty = array_type_get_flat_element(tid, len);
     ret = src_type(type_id_for(elemty));
+  } else if (m_constant_pointer_types.count(val)) {
+    ret = m_constant_pointer_types.at(val);
   } else {
     ret = src_type(tid);
   }
@@ -189,7 +604,6 @@ translator::src_type_memory_object_declaration(uint32_t tid, uint32_t val,
   }
   ret += " " + name;
   if (type_for(tid)->kind() == Type::Kind::kArray) {
-    auto len = array_type_get_length(tid);
     ret += "[" + std::to_string(len) + "]";
   }
   return ret;
@@ -276,7 +690,8 @@ translator::translate_extended_ternary(const Instruction &inst) const {
   auto c = inst.GetSingleWordOperand(6);
   auto fn_signed = gExtendedInstructionsTernary.at(extinst);
   if (fn_signed.second) {
-    return src_as(rtype, src_function_call_signed(fn_signed.first, a, b, c));
+    return src_as_result(rtype,
+                         src_function_call_signed(fn_signed.first, a, b, c));
   } else {
     return src_function_call(fn_signed.first, a, b, c);
   }
@@ -344,7 +759,8 @@ translator::translate_extended_binary(const Instruction &inst) const {
   auto y = inst.GetSingleWordOperand(5);
   auto fn_signed = gExtendedInstructionsBinary.at(extinst);
   if (fn_signed.second) {
-    return src_as(rtype, src_function_call_signed(fn_signed.first, x, y));
+    return src_as_result(rtype,
+                         src_function_call_signed(fn_signed.first, x, y));
   } else {
     return src_function_call(fn_signed.first, x, y);
   }
@@ -709,123 +1125,1094 @@ std::string translator::builtin_vector_extract(uint32_t id, uint32_t idx, bool c
   }
 }
 
-bool translator::translate_instruction(const Instruction &inst,
-                                       std::string &src) {
-  auto opcode = inst.opcode();
-  auto rtype = inst.type_id();
-  auto result = inst.result_id();
-
-  std::string sval;
-  bool assign_result = true;
-  bool boolean_result = false;
-  std::string boolean_result_src_type;
+bool translator::get_group_prefix(uint32_t scope, std::string &prefix) const {
+  auto cstmgr = m_ir->get_constant_mgr();
+  auto scope_cst = cstmgr->FindDeclaredConstant(scope);
+  if (scope_cst == nullptr) {
+    std::cerr << "UNIMPLEMENTED group operation with non-constant scope"
+              << std::endl;
+    return false;
+  }
 
-  switch (opcode) {
-  case spv::Op::OpUndef: {
-    if (!get_null_constant(rtype, sval)) {
+  switch (scope_cst->GetU32()) {
+  case SpvScopeWorkgroup:
+    // Work-group collectives were introduced in OpenCL C 2.0
+    if (m_clc_version < 200) {
+      std::cerr << "UNIMPLEMENTED work-group operation for OpenCL C "
+                << m_clc_version << std::endl;
       return false;
     }
+    prefix = "work_group_";
     break;
-  }
-  case spv::Op::OpUnreachable: // TODO trigger crash? end invocation?
-    break;
-  case spv::Op::OpReturn:
-    src = "return";
-    break;
-  case spv::Op::OpReturnValue: {
-    auto val = inst.GetSingleWordOperand(0);
-    src = "return " + var_for(val);
+  case SpvScopeSubgroup:
+    prefix = "sub_group_";
     break;
+  default:
+    std::cerr << "UNIMPLEMENTED group operation with scope "
+              << scope_cst->GetU32() << std::endl;
+    return false;
   }
-  case spv::Op::OpFunctionCall: {
-    auto func = inst.GetSingleWordOperand(2);
-    sval = var_for(func) + "(";
-    const char *sep = "";
-    for (unsigned i = 3; i < inst.NumOperands(); i++) {
-      auto param = inst.GetSingleWordOperand(i);
-      sval += sep;
-      sval += var_for(param);
-      sep = ", ";
-    }
-    sval += ")";
-    if (type_for(rtype)->kind() == Type::Kind::kVoid) {
-      assign_result = false;
-      src = sval;
+
+  return true;
+}
+
+std::string translator::src_subgroup_block_io(const std::string &fn,
+                                              uint32_t tyid) const {
+  // intel_sub_group_block_{read,write}[_us,_uc,_ul][N]
+  auto type = type_for(tyid);
+  uint32_t ncomp = 1;
+  if (type->kind() == Type::Kind::kVector) {
+    ncomp = type->AsVector()->element_count();
+    type = type_for(type_id_for(type->AsVector()->element_type()));
+  }
+
+  std::string ret = fn;
+  if (type->kind() == Type::Kind::kInteger) {
+    switch (type->AsInteger()->width()) {
+    case 8:
+      ret += "_uc";
+      break;
+    case 16:
+      ret += "_us";
+      break;
+    case 64:
+      ret += "_ul";
+      break;
+    default:
+      break;
     }
-    break;
   }
-  case spv::Op::OpCopyObject: {
-    auto obj = inst.GetSingleWordOperand(2);
-    sval = var_for(obj);
-    break;
+
+  if (ncomp > 1) {
+    ret += std::to_string(ncomp);
   }
-  case spv::Op::OpLifetimeStart:
-  case spv::Op::OpLifetimeStop:
+
+  return ret;
+}
+
+std::string translator::src_mem_fence_flags(uint32_t semantics) const {
+  std::string flags;
+  const char *sep = "";
+  if (semantics & SpvMemorySemanticsWorkgroupMemoryMask) {
+    flags += "CLK_LOCAL_MEM_FENCE";
+    sep = " | ";
+  }
+  if ((semantics & SpvMemorySemanticsCrossWorkgroupMemoryMask) ||
+      ((semantics & SpvMemorySemanticsImageMemoryMask) &&
+       (m_clc_version < 200))) {
+    flags += sep;
+    flags += "CLK_GLOBAL_MEM_FENCE";
+    sep = " | ";
+  }
+  if ((semantics & SpvMemorySemanticsImageMemoryMask) &&
+      (m_clc_version >= 200)) {
+    flags += sep;
+    flags += "CLK_IMAGE_MEM_FENCE";
+  }
+  if (flags == "") {
+    flags = "0";
+  }
+  return flags;
+}
+
+bool translator::get_memory_order(uint32_t semantics,
+                                  std::string &order) const {
+  auto cstmgr = m_ir->get_constant_mgr();
+  auto sem_cst = cstmgr->FindDeclaredConstant(semantics);
+  if (sem_cst == nullptr) {
+    std::cerr << "UNIMPLEMENTED non-constant memory semantics" << std::endl;
+    return false;
+  }
+
+  auto sem = sem_cst->GetU32();
+  switch (sem & gMemorySemanticsOrderingMask) {
+  case SpvMemorySemanticsMaskNone:
+    order = "memory_order_relaxed";
     break;
-  case spv::Op::OpVariable: {
-    // auto storage = inst.GetSingleWordOperand(2); TODO make storage explicit?
-    assign_result = false;
-    auto varty = type_for(rtype)->AsPointer()->pointee_type();
-    auto storagename = var_for(result) + "_storage";
-    storagename = make_valid_identifier(storagename);
-    // Declare storage
-    auto tymgr = m_ir->get_type_mgr();
-    src = src_type_memory_object_declaration(tymgr->GetId(varty), result,
-                                             storagename);
-    if (inst.NumOperands() == 4) {
-      auto init = inst.GetSingleWordOperand(3);
-      src += " = " + var_for(init);
-    }
-    src += "; ";
-    // Declare pointer
-    src += src_type(rtype) + " " + var_for(result) + " = &" + storagename;
+  case SpvMemorySemanticsAcquireMask:
+    order = "memory_order_acquire";
     break;
-  }
-  case spv::Op::OpLoad: {
-    auto ptr = inst.GetSingleWordOperand(2);
-    if (m_builtin_variables.count(ptr)) {
-      m_builtin_values[result] = m_builtin_variables.at(ptr);
-      assign_result = false;
-    } else {
-      sval = "*" + var_for(ptr);
-    }
+  case SpvMemorySemanticsReleaseMask:
+    order = "memory_order_release";
     break;
-  }
-  case spv::Op::OpStore: {
-    auto ptr = inst.GetSingleWordOperand(0);
-    auto val = inst.GetSingleWordOperand(1);
-    src = "*" + var_for(ptr) + " = " + var_for(val);
+  case SpvMemorySemanticsAcquireReleaseMask:
+    order = "memory_order_acq_rel";
     break;
-  }
-  case spv::Op::OpConvertPtrToU:
-  case spv::Op::OpConvertUToPtr: {
-    auto src = inst.GetSingleWordOperand(2);
-    sval = src_cast(rtype, src);
+  case SpvMemorySemanticsSequentiallyConsistentMask:
+    order = "memory_order_seq_cst";
     break;
+  default:
+    std::cerr << "UNIMPLEMENTED memory semantics " << sem << std::endl;
+    return false;
   }
-  case spv::Op::OpInBoundsPtrAccessChain: {
-    auto base = inst.GetSingleWordOperand(2);
-    auto elem = inst.GetSingleWordOperand(3);
-    sval = "&" + var_for(base) + "[" + var_for(elem) + "]";
-    const Type *cty = type_for_val(base)->AsPointer()->pointee_type();
-    for (unsigned i = 4; i < inst.NumOperands(); i++) {
-      auto idx = inst.GetSingleWordOperand(i);
-      sval = src_access_chain(sval, cty, idx);
-      switch (cty->kind()) {
-      case Type::Kind::kArray:
-        cty = cty->AsArray()->element_type();
-        break;
-      case Type::Kind::kStruct:
-        cty = cty->AsStruct()->element_types()[idx];
-        break;
-      default:
-        std::cerr << "UNIMPLEMENTED access chain type " << cty->kind()
-                  << std::endl;
-        return false;
+
+  return true;
+}
+
+bool translator::get_access_memory_order(uint32_t semantics, bool load,
+                                         std::string &order) const {
+  if (!get_memory_order(semantics, order)) {
+    return false;
+  }
+
+  // OpenCL C doesn't allow release or acq_rel on loads nor acquire or acq_rel
+  // on stores, use the closest order that is at least as strong
+  if (order == "memory_order_acq_rel") {
+    order = "memory_order_seq_cst";
+  } else if (load && (order == "memory_order_release")) {
+    order = "memory_order_acquire";
+  } else if (!load && (order == "memory_order_acquire")) {
+    order = "memory_order_release";
+  }
+
+  return true;
+}
+
+bool translator::get_memory_scope(uint32_t scope, std::string &src) const {
+  auto cstmgr = m_ir->get_constant_mgr();
+  auto scope_cst = cstmgr->FindDeclaredConstant(scope);
+  if (scope_cst == nullptr) {
+    std::cerr << "UNIMPLEMENTED non-constant memory scope" << std::endl;
+    return false;
+  }
+
+  switch (scope_cst->GetU32()) {
+  case SpvScopeCrossDevice:
+    if (m_clc_version >= 300) {
+      src = "memory_scope_all_devices";
+    } else {
+      src = "memory_scope_all_svm_devices";
+    }
+    break;
+  case SpvScopeDevice:
+    src = "memory_scope_device";
+    break;
+  // OpenCL C only allows memory_scope_work_item for image fences, use the
+  // narrowest scope that is valid for all operations instead.
+  case SpvScopeInvocation:
+  case SpvScopeWorkgroup:
+    src = "memory_scope_work_group";
+    break;
+  case SpvScopeSubgroup:
+    src = "memory_scope_sub_group";
+    break;
+  default:
+    std::cerr << "UNIMPLEMENTED memory scope " << scope_cst->GetU32()
+              << std::endl;
+    return false;
+  }
+
+  return true;
+}
+
+std::string translator::src_atomic_pointer(uint32_t ptr, bool signedty) const {
+  // ((volatile <address space> atomic_<type> *)ptr)
+  auto ptrty = type_for_val(ptr)->AsPointer();
+  auto storage = static_cast<uint32_t>(ptrty->storage_class());
+  auto pointee = type_id_for(ptrty->pointee_type());
+  std::string ret = "((volatile ";
+  std::string addrspace;
+  if (!get_address_space(storage, addrspace)) {
+    return "UNIMPLEMENTED";
+  }
+  if (addrspace != "") {
+    ret += addrspace + " ";
+  }
+  ret += "atomic_";
+  if (signedty) {
+    ret += src_type_signed(pointee);
+  } else {
+    ret += src_type(pointee);
+  }
+  ret += " *)" + var_for(ptr) + ")";
+  return ret;
+}
+
+bool translator::translate_atomic_explicit(const Instruction &inst,
+                                           std::string &src) const {
+  static std::unordered_map<spv::Op, std::pair<const std::string, bool>> fns{
+      {spv::Op::OpAtomicExchange, {"atomic_exchange_explicit", false}},
+      {spv::Op::OpAtomicIIncrement, {"atomic_fetch_add_explicit", false}},
+      {spv::Op::OpAtomicIDecrement, {"atomic_fetch_sub_explicit", false}},
+      {spv::Op::OpAtomicIAdd, {"atomic_fetch_add_explicit", false}},
+      {spv::Op::OpAtomicISub, {"atomic_fetch_sub_explicit", false}},
+      {spv::Op::OpAtomicSMin, {"atomic_fetch_min_explicit", true}},
+      {spv::Op::OpAtomicUMin, {"atomic_fetch_min_explicit", false}},
+      {spv::Op::OpAtomicSMax, {"atomic_fetch_max_explicit", true}},
+      {spv::Op::OpAtomicUMax, {"atomic_fetch_max_explicit", false}},
+      {spv::Op::OpAtomicAnd, {"atomic_fetch_and_explicit", false}},
+      {spv::Op::OpAtomicOr, {"atomic_fetch_or_explicit", false}},
+      {spv::Op::OpAtomicXor, {"atomic_fetch_xor_explicit", false}},
+  };
+
+  auto opcode = inst.opcode();
+  auto rtype = inst.type_id();
+  auto result = inst.result_id();
+
+  std::string order, scope;
+
+  switch (opcode) {
+  case spv::Op::OpAtomicLoad: {
+    auto ptr = inst.GetSingleWordOperand(2);
+    if (!get_memory_scope(inst.GetSingleWordOperand(3), scope) ||
+        !get_access_memory_order(inst.GetSingleWordOperand(4), true, order)) {
+      return false;
+    }
+    src = src_var_decl(result) + " = " +
+          src_function_call("atomic_load_explicit",
+                            src_atomic_pointer(ptr, false) + ", " + order +
+                                ", " + scope);
+    break;
+  }
+  case spv::Op::OpAtomicStore: {
+    auto ptr = inst.GetSingleWordOperand(0);
+    auto val = inst.GetSingleWordOperand(3);
+    if (!get_memory_scope(inst.GetSingleWordOperand(1), scope) ||
+        !get_access_memory_order(inst.GetSingleWordOperand(2), false, order)) {
+      return false;
+    }
+    src = src_function_call("atomic_store_explicit",
+                            src_atomic_pointer(ptr, false) + ", " +
+                                var_for(val) + ", " + order + ", " + scope);
+    break;
+  }
+  case spv::Op::OpAtomicCompareExchange:
+  case spv::Op::OpAtomicCompareExchangeWeak: {
+    auto ptr = inst.GetSingleWordOperand(2);
+    auto val = inst.GetSingleWordOperand(6);
+    auto cmp = inst.GetSingleWordOperand(7);
+    std::string order_unequal;
+    if (!get_memory_scope(inst.GetSingleWordOperand(3), scope) ||
+        !get_memory_order(inst.GetSingleWordOperand(4), order) ||
+        !get_access_memory_order(inst.GetSingleWordOperand(5), true,
+                                 order_unequal)) {
+      return false;
+    }
+    // The comparator is used as the expected value and receives the
+    // original value when the exchange fails.
+    std::string fn = opcode == spv::Op::OpAtomicCompareExchange
+                         ? "atomic_compare_exchange_strong_explicit"
+                         : "atomic_compare_exchange_weak_explicit";
+    src = src_var_decl(result) + " = " + var_for(cmp) + "; ";
+    src += src_function_call(fn, src_atomic_pointer(ptr, false) + ", &" +
+                                     var_for(result) + ", " + var_for(val) +
+                                     ", " + order + ", " + order_unequal +
+                                     ", " + scope);
+    break;
+  }
+  case spv::Op::OpAtomicFAddEXT: {
+    auto ptr = inst.GetSingleWordOperand(2);
+    auto val = inst.GetSingleWordOperand(5);
+    if (!get_memory_scope(inst.GetSingleWordOperand(3), scope) ||
+        !get_memory_order(inst.GetSingleWordOperand(4), order)) {
+      return false;
+    }
+    auto ptrty = type_for_val(ptr)->AsPointer();
+    auto width = ptrty->pointee_type()->AsFloat()->width();
+    std::string fty, ity, fp;
+    switch (width) {
+    case 32:
+      fty = "float";
+      ity = "uint";
+      fp = "fp32";
+      break;
+    case 64:
+      fty = "double";
+      ity = "ulong";
+      fp = "fp64";
+      break;
+    default:
+      std::cerr << "UNIMPLEMENTED OpAtomicFAddEXT with width " << width
+                << std::endl;
+      return false;
+    }
+    std::string addrspace;
+    auto storage = static_cast<uint32_t>(ptrty->storage_class());
+    if (!get_address_space(storage, addrspace)) {
+      return false;
+    }
+
+    // Floating-point atomics are only native with cl_ext_float_atomics,
+    // fall back to a compare-and-swap loop on the bit representation
+    auto old = var_for(result);
+    auto cur = old + "_cur";
+    auto iptr = "((volatile " + (addrspace.empty() ? "" : addrspace + " ") +
+                "atomic_" + ity + " *)" + var_for(ptr) + ")";
+    std::string fallback = ity + " " + cur + " = " +
+                           src_function_call("atomic_load_explicit",
+                                             iptr + ", memory_order_relaxed, " +
+                                                 scope) +
+                           "; ";
+    fallback += "while (!atomic_compare_exchange_weak_explicit(" + iptr +
+                ", &" + cur + ", as_" + ity + "(as_" + fty + "(" + cur +
+                ") + " + var_for(val) + "), " + order +
+                ", memory_order_relaxed, " + scope + ")) {} ";
+    fallback += old + " = as_" + fty + "(" + cur + ")";
+
+    std::string features;
+    auto add_feature = [&](const std::string &space) {
+      features += features.empty() ? "" : " && ";
+      features += "defined(__opencl_c_ext_" + fp + "_" + space + "_add)";
+    };
+    if ((storage == SpvStorageClassCrossWorkgroup) ||
+        (storage == SpvStorageClassGeneric)) {
+      add_feature("global");
+    }
+    if ((storage == SpvStorageClassWorkgroup) ||
+        (storage == SpvStorageClassGeneric)) {
+      add_feature("local");
+    }
+
+    src = src_var_decl(result) + "; ";
+    if (features.empty()) {
+      src += fallback;
+      break;
+    }
+    src += "\n#if " + features + "\n  ";
+    src += old + " = " +
+           src_function_call("atomic_fetch_add_explicit",
+                             src_atomic_pointer(ptr, false) + ", " +
+                                 var_for(val) + ", " + order + ", " + scope);
+    src += ";\n#else\n  " + fallback + ";\n#endif\n";
+    break;
+  }
+  default: {
+    auto ptr = inst.GetSingleWordOperand(2);
+    if (!get_memory_scope(inst.GetSingleWordOperand(3), scope) ||
+        !get_memory_order(inst.GetSingleWordOperand(4), order)) {
+      return false;
+    }
+    auto &fn_signed = fns.at(opcode);
+    std::string val;
+    if ((opcode == spv::Op::OpAtomicIIncrement) ||
+        (opcode == spv::Op::OpAtomicIDecrement)) {
+      val = "1";
+    } else if (fn_signed.second) {
+      val = src_as_signed(inst.GetSingleWordOperand(5));
+    } else {
+      val = var_for(inst.GetSingleWordOperand(5));
+    }
+    auto sval = src_function_call(fn_signed.first,
+                                  src_atomic_pointer(ptr, fn_signed.second) +
+                                      ", " + val + ", " + order + ", " + scope);
+    if (fn_signed.second) {
+      sval = src_as(rtype, sval);
+    }
+    src = src_var_decl(result) + " = " + sval;
+    break;
+  }
+  }
+
+  return true;
+}
+
+bool translator::translate_atomic(const Instruction &inst,
+                                  std::string &src) const {
+  if (m_clc_version >= 200) {
+    return translate_atomic_explicit(inst, src);
+  }
+
+  static std::unordered_map<spv::Op, std::pair<const std::string, bool>> fns{
+      {spv::Op::OpAtomicExchange, {"xchg", false}},
+      {spv::Op::OpAtomicIAdd, {"add", false}},
+      {spv::Op::OpAtomicISub, {"sub", false}},
+      {spv::Op::OpAtomicSMin, {"min", true}},
+      {spv::Op::OpAtomicUMin, {"min", false}},
+      {spv::Op::OpAtomicSMax, {"max", true}},
+      {spv::Op::OpAtomicUMax, {"max", false}},
+      {spv::Op::OpAtomicAnd, {"and", false}},
+      {spv::Op::OpAtomicOr, {"or", false}},
+      {spv::Op::OpAtomicXor, {"xor", false}},
+  };
+
+  auto opcode = inst.opcode();
+  auto rtype = inst.type_id();
+  auto result = inst.result_id();
+
+  auto ptr =
+      inst.GetSingleWordOperand(opcode == spv::Op::OpAtomicStore ? 0 : 2);
+  auto ptrty = type_for_val(ptr)->AsPointer();
+  auto pointee = ptrty->pointee_type();
+
+  // 64-bit integer atomics are provided by cl_khr_int64_base_atomics and
+  // cl_khr_int64_extended_atomics and use the atom_ prefix.
+  std::string prefix = "atomic_";
+  if ((pointee->kind() == Type::Kind::kInteger) &&
+      (pointee->AsInteger()->width() == 64)) {
+    prefix = "atom_";
+  }
+
+  std::string sval;
+
+  switch (opcode) {
+  case spv::Op::OpAtomicLoad: {
+    if (pointee->kind() != Type::Kind::kInteger) {
+      std::cerr << "UNIMPLEMENTED OpAtomicLoad with non-integer type"
+                << std::endl;
+      return false;
+    }
+    sval = src_function_call(prefix + "or", var_for(ptr) + ", 0");
+    break;
+  }
+  case spv::Op::OpAtomicStore: {
+    auto val = inst.GetSingleWordOperand(3);
+    src = src_function_call(prefix + "xchg", ptr, val);
+    break;
+  }
+  case spv::Op::OpAtomicIIncrement:
+    sval = src_function_call(prefix + "inc", ptr); // FIXME exact semantics
+    break;
+  case spv::Op::OpAtomicIDecrement:
+    sval = src_function_call(prefix + "dec", ptr); // FIXME exact semantics
+    break;
+  case spv::Op::OpAtomicAnd:
+  case spv::Op::OpAtomicExchange:
+  case spv::Op::OpAtomicIAdd:
+  case spv::Op::OpAtomicISub:
+  case spv::Op::OpAtomicOr:
+  case spv::Op::OpAtomicSMax:
+  case spv::Op::OpAtomicSMin:
+  case spv::Op::OpAtomicUMax:
+  case spv::Op::OpAtomicUMin:
+  case spv::Op::OpAtomicXor: {
+    auto val = inst.GetSingleWordOperand(5);
+    auto &fn_signed = fns.at(opcode);
+    auto fn = prefix + fn_signed.first; // FIXME exact semantics
+    if (fn_signed.second) {
+      sval = src_as_result(
+          rtype, src_function_call(fn, src_cast_signed(type_id_for(ptr), ptr) +
+                                           ", " + src_as_signed(val)));
+    } else {
+      sval = src_function_call(fn, ptr, val);
+    }
+    break;
+  }
+  case spv::Op::OpAtomicCompareExchange:
+  case spv::Op::OpAtomicCompareExchangeWeak: {
+    auto val = inst.GetSingleWordOperand(6);
+    auto cmp = inst.GetSingleWordOperand(7);
+    sval = src_function_call(prefix + "cmpxchg", ptr, cmp,
+                             val); // FIXME exact semantics
+    break;
+  }
+  case spv::Op::OpAtomicFAddEXT: {
+    // There are no floating-point atomics in OpenCL C 1.2, emulate the
+    // addition with a compare-and-swap loop on the bit representation.
+    auto val = inst.GetSingleWordOperand(5);
+    auto width = pointee->AsFloat()->width();
+    std::string fty, ity, cmpxchg;
+    switch (width) {
+    case 32:
+      fty = "float";
+      ity = "uint";
+      cmpxchg = "atomic_cmpxchg";
+      break;
+    case 64:
+      fty = "double";
+      ity = "ulong";
+      cmpxchg = "atom_cmpxchg";
+      break;
+    default:
+      std::cerr << "UNIMPLEMENTED OpAtomicFAddEXT with width " << width
+                << std::endl;
+      return false;
+    }
+    std::string addrspace;
+    if (!get_address_space(static_cast<uint32_t>(ptrty->storage_class()),
+                           addrspace)) {
+      return false;
+    }
+    auto iptr = "((volatile " + addrspace + " " + ity + " *)" + var_for(ptr) +
+                ")";
+    auto old = var_for(result);
+    auto cur = old + "_cur";
+    auto as_int = "as_" + ity;
+    src = src_var_decl(result) + " = *" + var_for(ptr) + "; ";
+    src += ity + " " + cur + "; ";
+    src += "while ((" + cur + " = " + cmpxchg + "(" + iptr + ", " + as_int +
+           "(" + old + "), " + as_int + "(" + old + " + " + var_for(val) +
+           "))) != " + as_int + "(" + old + ")) { " + old + " = as_" + fty +
+           "(" + cur + "); }";
+    return true;
+  }
+  default:
+    std::cerr << "UNIMPLEMENTED atomic instruction " << opcode << std::endl;
+    return false;
+  }
+
+  if (result != 0) {
+    src = src_var_decl(result) + " = " + sval;
+  }
+
+  return true;
+}
+
+bool translator::translate_copy_memory(const Instruction &inst,
+                                       std::string &src) const {
+  auto opcode = inst.opcode();
+  auto dst = inst.GetSingleWordOperand(0);
+  auto srcptr = inst.GetSingleWordOperand(1);
+  bool sized = opcode == spv::Op::OpCopyMemorySized;
+  uint32_t memops = sized ? 3 : 2;
+
+  auto dstpointee = type_for_val(dst)->AsPointer()->pointee_type();
+  auto srcpointee = type_for_val(srcptr)->AsPointer()->pointee_type();
+
+  // Copies of a whole object are plain assignments, C can't assign arrays
+  if (!sized && (dstpointee->kind() != Type::Kind::kArray)) {
+    src = "*" + var_for(dst) + " = *" + var_for(srcptr);
+    return true;
+  }
+
+  bool known_size = true;
+  uint64_t size = 0;
+  uint32_t sizeid = 0;
+  if (sized) {
+    sizeid = inst.GetSingleWordOperand(2);
+    auto sizedef = m_ir->get_def_use_mgr()->GetDef(sizeid);
+    if (sizedef->opcode() == spv::Op::OpConstant) {
+      size = sizedef->GetOperand(2).AsLiteralUint64();
+    } else {
+      known_size = false;
+    }
+  } else {
+    size = type_size(type_id_for(dstpointee));
+  }
+
+  // llvm-spirv lowers aggregate copies to OpCopyMemorySized on bitcast
+  // pointers, copy the original objects when the whole of them is copied.
+  auto underlying = [this](uint32_t ptr) {
+    auto def = m_ir->get_def_use_mgr()->GetDef(ptr);
+    while (def->opcode() == spv::Op::OpBitcast) {
+      ptr = def->GetSingleWordOperand(2);
+      def = m_ir->get_def_use_mgr()->GetDef(ptr);
+    }
+    return ptr;
+  };
+  if (known_size) {
+    auto odst = underlying(dst);
+    auto osrc = underlying(srcptr);
+    auto otype = type_for_val(odst)->AsPointer()->pointee_type();
+    auto otypeid = type_id_for(otype);
+    if ((otype->kind() != Type::Kind::kArray) &&
+        (otypeid == type_id_for(
+                        type_for_val(osrc)->AsPointer()->pointee_type())) &&
+        (type_size(otypeid) == size)) {
+      src = "*" + var_for(odst) + " = *" + var_for(osrc);
+      return true;
+    }
+  }
+
+  // Otherwise copy in the widest chunks the alignment of both pointers allows.
+  // Without an explicit alignment, use the best of the pointer and the object
+  // it was cast from, memcpy-style copies are made on uchar pointers.
+  auto alignment = [&](uint32_t ptr, const Type *pointee) {
+    auto align = access_alignment(inst, ptr, memops);
+    if (align == 0) {
+      align = type_alignment(type_id_for(pointee));
+      auto optr = underlying(ptr);
+      if (optr != ptr) {
+        auto oalign = m_alignments.count(optr) ? m_alignments.at(optr) : 0;
+        auto opointee = type_for_val(optr)->AsPointer()->pointee_type();
+        oalign = std::max(oalign, type_alignment(type_id_for(opointee)));
+        align = std::max(align, oalign);
+      }
+    }
+    return align;
+  };
+  auto align = std::min(alignment(dst, dstpointee),
+                        alignment(srcptr, srcpointee));
+  uint32_t width = 16;
+  while ((width > 1) &&
+         ((width > align) || (known_size && (width > size)))) {
+    width /= 2;
+  }
+
+  auto chunk_copy = [&](uint32_t chunk, const std::string &index) {
+    auto &ty = gCopyMemoryChunkTypes.at(chunk);
+    return src_pointer_cast(dst, ty) + "[" + index + "] = " +
+           src_pointer_cast(srcptr, ty) + "[" + index + "]; ";
+  };
+  auto idx = var_for(dst) + "_i";
+
+  if (!known_size) {
+    auto srcsize = var_for(sizeid);
+    src = "for (size_t " + idx + " = 0; " + idx + " < " + srcsize + " / " +
+          std::to_string(width) + "; " + idx + "++) { " +
+          chunk_copy(width, idx) + "}";
+    if (width > 1) {
+      src += " for (size_t " + idx + " = " + srcsize + " & ~" +
+             std::to_string(width - 1) + "; " + idx + " < " + srcsize + "; " +
+             idx + "++) { " + chunk_copy(1, idx) + "}";
+    }
+    return true;
+  }
+
+  auto chunks = size / width;
+  if (chunks > gCopyMemoryMaxUnroll) {
+    src = "for (size_t " + idx + " = 0; " + idx + " < " +
+          std::to_string(chunks) + "; " + idx + "++) { " +
+          chunk_copy(width, idx) + "}; ";
+  } else {
+    for (uint64_t i = 0; i < chunks; i++) {
+      src += chunk_copy(width, std::to_string(i));
+    }
+  }
+
+  // Copy the remaining bytes in decreasing chunk sizes, the offsets remain
+  // aligned to the chunk sizes
+  auto offset = chunks * width;
+  for (uint32_t chunk = width / 2; chunk > 0; chunk /= 2) {
+    if ((size - offset) >= chunk) {
+      src += chunk_copy(chunk, std::to_string(offset / chunk));
+      offset += chunk;
+    }
+  }
+
+  // Drop the trailing separator, the caller terminates the statement
+  if (src.size() >= 2) {
+    src.resize(src.size() - 2);
+  }
+  return true;
+}
+
+std::string
+translator::src_swizzle(uint32_t vec,
+                        const std::vector<uint32_t> &comps) const {
+  auto n = type_for_val(vec)->AsVector()->element_count();
+  auto k = comps.size();
+  if (k == 1) {
+    return src_vec_comp(vec, comps[0]);
+  }
+
+  bool identity = k == n;
+  bool lo = true, hi = true, even = true, odd = true;
+  for (unsigned i = 0; i < k; i++) {
+    identity = identity && (comps[i] == i);
+    lo = lo && (comps[i] == i);
+    hi = hi && (comps[i] == n / 2 + i);
+    even = even && (comps[i] == 2 * i);
+    odd = odd && (comps[i] == 2 * i + 1);
+  }
+  if (identity) {
+    return var_for(vec);
+  }
+  // .lo and .hi of 3-component vectors include an undefined component
+  if ((n != 3) && (k == n / 2)) {
+    if (lo) {
+      return var_for(vec) + ".lo";
+    } else if (hi) {
+      return var_for(vec) + ".hi";
+    } else if (even) {
+      return var_for(vec) + ".even";
+    } else if (odd) {
+      return var_for(vec) + ".odd";
+    }
+  }
+
+  std::stringstream swizzle;
+  swizzle << ".s" << std::hex;
+  for (auto comp : comps) {
+    swizzle << comp;
+  }
+  return var_for(vec) + swizzle.str();
+}
+
+void translator::src_swizzle_pieces(
+    const std::vector<std::pair<uint32_t, uint32_t>> &comps,
+    std::vector<std::string> &pieces) const {
+  // Split into runs of components of the same vector whose length is a
+  // valid vector size so that each can be a single swizzle
+  for (unsigned i = 0; i < comps.size();) {
+    unsigned run = 1;
+    while ((i + run < comps.size()) &&
+           (comps[i + run].first == comps[i].first)) {
+      run++;
+    }
+    for (auto len : {16U, 8U, 4U, 3U, 2U, 1U}) {
+      if (len <= run) {
+        run = len;
+        break;
+      }
+    }
+    std::vector<uint32_t> indices;
+    for (unsigned j = i; j < i + run; j++) {
+      indices.push_back(comps[j].second);
+    }
+    pieces.push_back(src_swizzle(comps[i].first, indices));
+    i += run;
+  }
+}
+
+std::string
+translator::src_vector_literal(uint32_t tyid,
+                               const std::vector<std::string> &pieces) const {
+  if (pieces.size() == 1) {
+    return pieces[0];
+  }
+  std::string ret = "((" + src_type(tyid) + ")(";
+  const char *sep = "";
+  for (auto &piece : pieces) {
+    ret += sep + piece;
+    sep = ", ";
+  }
+  ret += "))";
+  return ret;
+}
+
+std::string translator::src_vector_shuffle(const Instruction &inst) const {
+  auto rtype = inst.type_id();
+  auto v1 = inst.GetSingleWordOperand(2);
+  auto v2 = inst.GetSingleWordOperand(3);
+  auto n1 = type_for_val(v1)->AsVector()->element_count();
+  auto n2 = type_for_val(v2)->AsVector()->element_count();
+
+  std::vector<std::pair<uint32_t, uint32_t>> comps;
+  std::vector<uint32_t> mask;
+  bool single = true;
+  for (unsigned i = 4; i < inst.NumOperands(); i++) {
+    auto comp = inst.GetSingleWordOperand(i);
+    if (comp == 0xFFFFFFFFU) {
+      // Undefined components extend the previous run
+      if (comps.empty()) {
+        comps.emplace_back(v1, 0);
+      } else {
+        auto &prev = comps.back();
+        auto nprev = (prev.first == v1) ? n1 : n2;
+        comps.emplace_back(prev.first, (prev.second + 1) % nprev);
       }
+    } else if (comp >= n1) {
+      comps.emplace_back(v2, comp - n1);
+      single = false;
+    } else {
+      comps.emplace_back(v1, comp);
+    }
+    mask.push_back(comps.back().second +
+                   ((comps.back().first == v1) ? 0 : n1));
+  }
+
+  std::vector<std::string> pieces;
+  src_swizzle_pieces(comps, pieces);
+
+  // Many pieces make for a large literal, use shuffle/shuffle2 when the
+  // vector sizes allow it
+  auto vecty = type_for(rtype)->AsVector();
+  auto elemty = vecty->element_type();
+  auto is_shuffle_size = [](uint32_t n) {
+    return (n == 2) || (n == 4) || (n == 8) || (n == 16);
+  };
+  uint32_t width = 0;
+  if (elemty->kind() == Type::Kind::kInteger) {
+    width = elemty->AsInteger()->width();
+  } else if (elemty->kind() == Type::Kind::kFloat) {
+    width = elemty->AsFloat()->width();
+  }
+  static const std::unordered_map<uint32_t, std::string> mask_types = {
+      {8, "uchar"}, {16, "ushort"}, {32, "uint"}, {64, "ulong"}};
+  if ((pieces.size() > 4) && mask_types.count(width) &&
+      is_shuffle_size(vecty->element_count()) && is_shuffle_size(n1) &&
+      (single || (n1 == n2))) {
+    std::string smask = "((" + mask_types.at(width) +
+                        std::to_string(vecty->element_count()) + ")(";
+    const char *sep = "";
+    for (auto idx : mask) {
+      smask += sep + std::to_string(idx);
+      sep = ", ";
+    }
+    smask += "))";
+    if (single) {
+      return "shuffle(" + var_for(v1) + ", " + smask + ")";
+    }
+    return "shuffle2(" + var_for(v1) + ", " + var_for(v2) + ", " + smask +
+           ")";
+  }
+
+  return src_vector_literal(rtype, pieces);
+}
+
+std::string
+translator::src_vector_construct(const Instruction &inst) const {
+  // Look through extractions of single components so that runs of them can
+  // be turned into swizzles. Phi variables may be reassigned after the
+  // extraction so those are kept as is.
+  auto defuse = m_ir->get_def_use_mgr();
+  std::vector<std::pair<uint32_t, uint32_t>> comps;
+  std::vector<std::string> pieces;
+  for (unsigned i = 2; i < inst.NumOperands(); i++) {
+    auto val = inst.GetSingleWordOperand(i);
+    auto def = defuse->GetDef(val);
+    if ((def->opcode() == spv::Op::OpCompositeExtract) &&
+        (def->NumOperands() == 4)) {
+      auto vec = def->GetSingleWordOperand(2);
+      if ((type_for_val(vec)->kind() == Type::Kind::kVector) &&
+          (defuse->GetDef(vec)->opcode() != spv::Op::OpPhi) &&
+          (m_builtin_values.count(vec) == 0)) {
+        comps.emplace_back(vec, def->GetSingleWordOperand(3));
+        continue;
+      }
+    }
+    src_swizzle_pieces(comps, pieces);
+    comps.clear();
+    pieces.push_back(var_for(val));
+  }
+  src_swizzle_pieces(comps, pieces);
+
+  return src_vector_literal(inst.type_id(), pieces);
+}
+
+bool translator::is_inlinable_condition(const Instruction &inst) const {
+  auto result = inst.result_id();
+  if (!m_inline_conditions || m_names.count(result) ||
+      (type_for(inst.type_id())->kind() != Type::Kind::kBool) ||
+      (gConditionOpcodes.count(inst.opcode()) == 0)) {
+    return false;
+  }
+
+  // Phi variables are reassigned at the end of blocks, an expression that
+  // reads them can't be moved
+  auto defuse = m_ir->get_def_use_mgr();
+  bool inlinable = true;
+  inst.ForEachInId([&](const uint32_t *id) {
+    auto def = defuse->GetDef(*id);
+    if ((def != nullptr) && (def->opcode() == spv::Op::OpPhi)) {
+      inlinable = false;
+    }
+  });
+
+  // The condition must be used once, in the same block and not by a phi
+  auto block = m_ir->get_instr_block(const_cast<Instruction *>(&inst));
+  uint32_t uses = 0;
+  defuse->ForEachUser(result, [&](Instruction *user) {
+    switch (user->opcode()) {
+    case spv::Op::OpName:
+    case spv::Op::OpDecorate:
+      return;
+    case spv::Op::OpPhi:
+      inlinable = false;
+      break;
+    default:
+      if (m_ir->get_instr_block(user) != block) {
+        inlinable = false;
+      }
+      break;
+    }
+    uses++;
+  });
+
+  return inlinable && (uses == 1);
+}
+
+bool translator::flatten_selection(const Instruction &branch, uint32_t merge,
+                                   std::string &src) const {
+  auto cond = branch.GetSingleWordOperand(0);
+  auto header = m_ir->get_instr_block(const_cast<Instruction *>(&branch));
+
+  // Only selections whose sides branch straight to the merge block can be
+  // turned into selects. Return the predecessor of the merge block on the
+  // side starting at target, 0 when the side isn't empty.
+  auto side_predecessor = [&](uint32_t target) -> uint32_t {
+    if (target == merge) {
+      return header->id();
+    }
+    auto bb = m_ir->get_instr_block(target);
+    auto &first = *bb->begin();
+    if ((&first != bb->terminator()) ||
+        (first.opcode() != spv::Op::OpBranch) ||
+        (first.GetSingleWordOperand(0) != merge)) {
+      return 0;
+    }
+    return target;
+  };
+
+  auto pred_true = side_predecessor(branch.GetSingleWordOperand(1));
+  auto pred_false = side_predecessor(branch.GetSingleWordOperand(2));
+  if ((pred_true == 0) || (pred_false == 0)) {
+    return false;
+  }
+
+  std::string selects;
+  for (auto &phi : *m_ir->get_instr_block(merge)) {
+    if (phi.opcode() != spv::Op::OpPhi) {
+      break;
+    }
+    if (type_for(phi.type_id())->kind() == Type::Kind::kArray) {
+      return false;
+    }
+    std::string val_true, val_false;
+    for (unsigned i = 2; i < phi.NumOperands(); i += 2) {
+      auto val = phi.GetSingleWordOperand(i);
+      auto parent = phi.GetSingleWordOperand(i + 1);
+      if (parent == pred_true) {
+        val_true = var_for(val);
+      }
+      if (parent == pred_false) {
+        val_false = var_for(val);
+      }
+    }
+    if (val_true.empty() || val_false.empty()) {
+      return false;
+    }
+    selects += var_for(phi.result_id()) + " = " + var_for(cond) + " ? " +
+               val_true + " : " + val_false + "; ";
+  }
+
+  src = selects + "goto " + var_for(merge);
+  return true;
+}
+
+bool translator::translate_instruction(const Instruction &inst,
+                                       std::string &src) {
+  auto opcode = inst.opcode();
+  auto rtype = inst.type_id();
+  auto result = inst.result_id();
+
+  std::string sval;
+  bool assign_result = true;
+  bool boolean_result = false;
+  std::string boolean_result_src_type;
+
+  switch (opcode) {
+  case spv::Op::OpUndef: {
+    if (!get_null_constant(rtype, sval)) {
+      return false;
     }
     break;
   }
+  case spv::Op::OpUnreachable: // TODO trigger crash? end invocation?
+    break;
+  case spv::Op::OpReturn:
+    src = "return";
+    break;
+  case spv::Op::OpReturnValue: {
+    auto val = inst.GetSingleWordOperand(0);
+    src = "return " + var_for(val);
+    break;
+  }
+  case spv::Op::OpFunctionCall: {
+    auto func = inst.GetSingleWordOperand(2);
+    sval = var_for(func) + "(";
+    const char *sep = "";
+    for (unsigned i = 3; i < inst.NumOperands(); i++) {
+      auto param = inst.GetSingleWordOperand(i);
+      sval += sep;
+      sval += var_for(param);
+      sep = ", ";
+    }
+    sval += ")";
+    if (type_for(rtype)->kind() == Type::Kind::kVoid) {
+      assign_result = false;
+      src = sval;
+    }
+    break;
+  }
+  case spv::Op::OpCopyObject: {
+    auto obj = inst.GetSingleWordOperand(2);
+    sval = var_for(obj);
+    break;
+  }
+  case spv::Op::OpLifetimeStart:
+  case spv::Op::OpLifetimeStop:
+    break;
+  case spv::Op::OpVariable: {
+    // auto storage = inst.GetSingleWordOperand(2); TODO make storage explicit?
+    assign_result = false;
+    auto varty = type_for(rtype)->AsPointer()->pointee_type();
+    auto storagename = var_for(result) + "_storage";
+    storagename = make_valid_identifier(storagename);
+    // Declare storage
+    auto tymgr = m_ir->get_type_mgr();
+    src = src_type_memory_object_declaration(tymgr->GetId(varty), result,
+                                             storagename);
+    if (inst.NumOperands() == 4) {
+      auto init = inst.GetSingleWordOperand(3);
+      src += " = " + src_initializer(init);
+    }
+    src += "; ";
+    // Declare pointer
+    src += src_type(rtype) + " " + var_for(result) + " = &" + storagename;
+    break;
+  }
+  case spv::Op::OpLoad: {
+    auto ptr = inst.GetSingleWordOperand(2);
+    if (m_builtin_variables.count(ptr)) {
+      m_builtin_values[result] = m_builtin_variables.at(ptr);
+      assign_result = false;
+    } else if (is_underaligned_vector_access(inst, ptr, rtype, 3)) {
+      auto n = type_for(rtype)->AsVector()->element_count();
+      sval = "vload" + std::to_string(n) + "(0, " +
+             src_vector_access_pointer(ptr, rtype) + ")";
+    } else {
+      sval = "*" + var_for(ptr);
+    }
+    break;
+  }
+  case spv::Op::OpStore: {
+    auto ptr = inst.GetSingleWordOperand(0);
+    auto val = inst.GetSingleWordOperand(1);
+    auto valty = type_id_for(val);
+    if (is_underaligned_vector_access(inst, ptr, valty, 2)) {
+      auto n = type_for(valty)->AsVector()->element_count();
+      src = "vstore" + std::to_string(n) + "(" + var_for(val) + ", 0, " +
+            src_vector_access_pointer(ptr, valty) + ")";
+    } else {
+      src = "*" + var_for(ptr) + " = " + var_for(val);
+    }
+    break;
+  }
+  case spv::Op::OpCopyMemory:
+  case spv::Op::OpCopyMemorySized:
+    if (!translate_copy_memory(inst, src)) {
+      return false;
+    }
+    break;
+  case spv::Op::OpConvertPtrToU:
+  case spv::Op::OpConvertUToPtr:
+  case spv::Op::OpPtrCastToGeneric:
+  case spv::Op::OpGenericCastToPtr: {
+    auto src = inst.GetSingleWordOperand(2);
+    sval = src_cast(rtype, src);
+    break;
+  }
+  case spv::Op::OpGenericCastToPtrExplicit: {
+    auto ptr = inst.GetSingleWordOperand(2);
+    auto storage = inst.GetSingleWordOperand(3);
+    switch (storage) {
+    case SpvStorageClassCrossWorkgroup:
+      sval = src_function_call("to_global", ptr);
+      break;
+    case SpvStorageClassWorkgroup:
+      sval = src_function_call("to_local", ptr);
+      break;
+    case SpvStorageClassFunction:
+      sval = src_function_call("to_private", ptr);
+      break;
+    default:
+      std::cerr << "UNIMPLEMENTED OpGenericCastToPtrExplicit storage class "
+                << storage << std::endl;
+      return false;
+    }
+    sval = src_cast(rtype, sval);
+    break;
+  }
+  case spv::Op::OpGenericPtrMemSemantics: {
+    // Translate the fence flags returned by get_fence to memory semantics
+    auto ptr = inst.GetSingleWordOperand(2);
+    auto fence = src_function_call("get_fence", ptr);
+    auto global = std::to_string(SpvMemorySemanticsCrossWorkgroupMemoryMask);
+    auto local = std::to_string(SpvMemorySemanticsWorkgroupMemoryMask);
+    sval = "((" + fence + " & CLK_GLOBAL_MEM_FENCE) ? " + global + " : 0) | ";
+    sval += "((" + fence + " & CLK_LOCAL_MEM_FENCE) ? " + local + " : 0)";
+    sval = src_cast(rtype, sval);
+    break;
+  }
+  case spv::Op::OpAccessChain:
+  case spv::Op::OpInBoundsAccessChain:
+  case spv::Op::OpPtrAccessChain:
+  case spv::Op::OpInBoundsPtrAccessChain:
+    if (!translate_access_chain(inst, sval)) {
+      return false;
+    }
+    break;
   case spv::Op::OpSampledImage: {
     auto image = inst.GetSingleWordOperand(2);
     auto sampler = inst.GetSingleWordOperand(3);
@@ -919,67 +2306,38 @@ bool translator::translate_instruction(const Instruction &inst,
     sval += "))";
     break;
   }
-  case spv::Op::OpAtomicIIncrement: {
-    auto ptr = inst.GetSingleWordOperand(2);
-    sval = src_function_call("atomic_inc", ptr); // FIXME exact semantics
-    break;
-  }
-  case spv::Op::OpAtomicIDecrement: {
-    auto ptr = inst.GetSingleWordOperand(2);
-    sval = src_function_call("atomic_dec", ptr); // FIXME exact semantics
-    break;
-  }
-  case spv::Op::OpAtomicAnd:
+  case spv::Op::OpAtomicLoad:
+  case spv::Op::OpAtomicStore:
   case spv::Op::OpAtomicExchange:
+  case spv::Op::OpAtomicCompareExchange:
+  case spv::Op::OpAtomicCompareExchangeWeak:
+  case spv::Op::OpAtomicIIncrement:
+  case spv::Op::OpAtomicIDecrement:
   case spv::Op::OpAtomicIAdd:
   case spv::Op::OpAtomicISub:
-  case spv::Op::OpAtomicOr:
-  case spv::Op::OpAtomicSMax:
   case spv::Op::OpAtomicSMin:
-  case spv::Op::OpAtomicUMax:
   case spv::Op::OpAtomicUMin:
-  case spv::Op::OpAtomicXor: {
-    static std::unordered_map<spv::Op, const char *> fns{
-        {spv::Op::OpAtomicAnd, "atomic_and"},
-        {spv::Op::OpAtomicExchange, "atomic_xchg"},
-        {spv::Op::OpAtomicIAdd, "atomic_add"},
-        {spv::Op::OpAtomicISub, "atomic_sub"},
-        {spv::Op::OpAtomicOr, "atomic_or"},
-        {spv::Op::OpAtomicSMax, "atomic_max"},
-        {spv::Op::OpAtomicSMin, "atomic_min"},
-        {spv::Op::OpAtomicUMax, "atomic_max"},
-        {spv::Op::OpAtomicUMin, "atomic_min"},
-        {spv::Op::OpAtomicXor, "atomic_xor"},
-    };
-    auto ptr = inst.GetSingleWordOperand(2);
-    auto val = inst.GetSingleWordOperand(5);
-    sval = src_function_call(fns.at(opcode), ptr, val); // FIXME exact semantics
-    break;
-  }
-  case spv::Op::OpAtomicCompareExchange: {
-    auto ptr = inst.GetSingleWordOperand(2);
-    auto val = inst.GetSingleWordOperand(6);
-    auto cmp = inst.GetSingleWordOperand(7);
-    sval = src_function_call("atomic_cmpxchg", ptr, cmp,
-                             val); // FIXME exact semantics
+  case spv::Op::OpAtomicSMax:
+  case spv::Op::OpAtomicUMax:
+  case spv::Op::OpAtomicAnd:
+  case spv::Op::OpAtomicOr:
+  case spv::Op::OpAtomicXor:
+  case spv::Op::OpAtomicFAddEXT: {
+    assign_result = false;
+    if (!translate_atomic(inst, src)) {
+      return false;
+    }
     break;
   }
   case spv::Op::OpCompositeExtract: {
     auto comp = inst.GetSingleWordOperand(2);
-    auto idx = inst.GetSingleWordOperand(3); // FIXME support multiple indices
-    if (m_builtin_values.count(comp)) {
+    auto idx = inst.GetSingleWordOperand(3);
+    if (m_builtin_values.count(comp) && (inst.NumOperands() == 4)) {
       sval = builtin_vector_extract(comp, idx, true);
       break;
     }
-    auto type = type_for_val(comp);
-    switch (type->kind()) {
-    case Type::Kind::kVector: {
-      sval = src_vec_comp(comp, idx);
-      break;
-    }
-    default:
-      std::cerr << "UNIMPLEMENTED OpCompositeExtract, type " << type->kind()
-                << std::endl;
+    sval = var_for(comp);
+    if (!src_composite_indices(sval, type_for_val(comp), inst, 3)) {
       return false;
     }
     break;
@@ -987,30 +2345,22 @@ bool translator::translate_instruction(const Instruction &inst,
   case spv::Op::OpCompositeInsert: {
     auto object = inst.GetSingleWordOperand(2);
     auto composite = inst.GetSingleWordOperand(3);
-    auto index = inst.GetSingleWordOperand(4);
-
-    if (inst.NumOperands() > 5) {
-      std::cerr << "UNIMPLEMENTED OpCompositeInsert with multiple indices"
-                << std::endl;
-      return false;
-    }
 
     assign_result = false;
     src = src_type(rtype) + " " + var_for(result) + " = " + var_for(composite) +
           "; ";
-    auto type = type_for(rtype);
-    switch (type->kind()) {
-    case Type::Kind::kVector:
-      src += src_vec_comp(result, index) + " = " + var_for(object);
-      break;
-    default:
-      std::cerr << "UNIMPLEMENTED OpCompositeInsert, type " << type->kind()
-                << std::endl;
+    auto lval = var_for(result);
+    if (!src_composite_indices(lval, type_for(rtype), inst, 4)) {
       return false;
     }
+    src += lval + " = " + var_for(object);
     break;
   }
   case spv::Op::OpCompositeConstruct: {
+    if (type_for(rtype)->kind() == Type::Kind::kVector) {
+      sval = src_vector_construct(inst);
+      break;
+    }
     sval = "{";
     const char *sep = "";
     for (unsigned i = 2; i < inst.NumOperands(); i++) {
@@ -1042,37 +2392,16 @@ bool translator::translate_instruction(const Instruction &inst,
     sval = var_for(vec);
     sval += "; ";
     sval += "((" + src_type(comp_type_id) + "*)&" + var_for(result) + ")[" +
-            var_for(idx) + "] = " + var_for(comp);
-    break;
-  }
-  case spv::Op::OpVectorShuffle: {
-    auto v1 = inst.GetSingleWordOperand(2);
-    auto v2 = inst.GetSingleWordOperand(3);
-    auto n1 = type_for_val(v1)->AsVector()->element_count();
-    sval = "((" + src_type(rtype) + ")(";
-    const char *sep = "";
-    for (unsigned i = 4; i < inst.NumOperands(); i++) {
-      auto comp = inst.GetSingleWordOperand(i);
-      auto srcvec = v1;
-      sval += sep;
-      if (comp == 0xFFFFFFFFU) {
-        sval += "0";
-      } else {
-        if (comp >= n1) {
-          srcvec = v2;
-          comp -= n1;
-        }
-        sval += src_vec_comp(srcvec, comp);
-      }
-      sep = ", ";
-    }
-    sval += "))";
+            var_for(idx) + "] = " + var_for(comp);
     break;
   }
+  case spv::Op::OpVectorShuffle:
+    sval = src_vector_shuffle(inst);
+    break;
   case spv::Op::OpSDiv:
   case spv::Op::OpSRem:
   case spv::Op::OpShiftRightArithmetic:
-    sval = src_as(rtype, translate_binop_signed(inst));
+    sval = src_as_result(rtype, translate_binop_signed(inst));
     break;
   case spv::Op::OpVectorTimesScalar:
   case spv::Op::OpShiftLeftLogical:
@@ -1286,8 +2615,10 @@ bool translator::translate_instruction(const Instruction &inst,
     auto val = inst.GetSingleWordOperand(2);
     auto dstty = type_for(rtype);
     auto srcty = type_for_val(val);
-    if ((srcty->kind() == Type::Kind::kPointer) ||
-        (dstty->kind() == Type::Kind::kPointer)) {
+    if (m_constant_pointer_types.count(result)) {
+      sval = "((" + src_type_for_value(result) + ")" + var_for(val) + ")";
+    } else if ((srcty->kind() == Type::Kind::kPointer) ||
+               (dstty->kind() == Type::Kind::kPointer)) {
       sval = src_cast(rtype, val);
     } else {
       sval = src_as(rtype, val);
@@ -1309,8 +2640,27 @@ bool translator::translate_instruction(const Instruction &inst,
     auto cond = inst.GetSingleWordOperand(2);
     auto val_true = inst.GetSingleWordOperand(3);
     auto val_false = inst.GetSingleWordOperand(4);
-    sval =
-        var_for(cond) + " ? " + var_for(val_true) + " : " + var_for(val_false);
+    auto condop = m_ir->get_def_use_mgr()->GetDef(cond)->opcode();
+    auto is_bool_constant = [this](uint32_t val, bool value) {
+      auto op = m_ir->get_def_use_mgr()->GetDef(val)->opcode();
+      return op == (value ? spv::Op::OpConstantTrue : spv::Op::OpConstantFalse);
+    };
+    if (condop == spv::Op::OpConstantTrue) {
+      sval = var_for(val_true);
+    } else if (condop == spv::Op::OpConstantFalse) {
+      sval = var_for(val_false);
+    } else if (val_true == val_false) {
+      sval = var_for(val_true);
+    } else if (is_bool_constant(val_true, true) &&
+               is_bool_constant(val_false, false)) {
+      sval = var_for(cond);
+    } else if (is_bool_constant(val_true, false) &&
+               is_bool_constant(val_false, true)) {
+      sval = "!" + var_for(cond);
+    } else {
+      sval = var_for(cond) + " ? " + var_for(val_true) + " : " +
+             var_for(val_false);
+    }
     break;
   }
   case spv::Op::OpBranch: {
@@ -1324,12 +2674,29 @@ bool translator::translate_instruction(const Instruction &inst,
     auto label_true = inst.GetSingleWordOperand(1);
     auto label_false = inst.GetSingleWordOperand(2);
     assign_result = false;
-    src = "if (" + var_for(cond) + ") { goto " + var_for(label_true) +
+    auto bb = m_ir->get_instr_block(const_cast<Instruction *>(&inst));
+    auto merge = bb->GetMergeInst();
+    if ((merge != nullptr) && (merge->opcode() == spv::Op::OpSelectionMerge) &&
+        (merge->GetSingleWordOperand(1) & SpvSelectionControlFlattenMask) &&
+        flatten_selection(inst, merge->GetSingleWordOperand(0), src)) {
+      break;
+    }
+    auto scond = var_for(cond);
+    if (inst.NumOperands() == 5) {
+      auto weight_true = inst.GetSingleWordOperand(3);
+      auto weight_false = inst.GetSingleWordOperand(4);
+      if (weight_true != weight_false) {
+        scond = "SPIRV2CLC_EXPECT(" + scond + ", " +
+                (weight_true > weight_false ? "1" : "0") + ")";
+      }
+    }
+    src = "if (" + scond + ") { goto " + var_for(label_true) +
           ";} else { goto " + var_for(label_false) + ";}";
     break;
   }
-  case spv::Op::OpLoopMerge:      // Nothing to do for now TODO loop controls
-  case spv::Op::OpSelectionMerge: // TODO selection controls
+  case spv::Op::OpLoopMerge: // Nothing to do for now TODO loop controls
+    break;
+  case spv::Op::OpSelectionMerge: // Handled with the branch
     break;
   case spv::Op::OpPhi: // Nothing to do here, phi registers are assigned
                        // elsewhere
@@ -1365,54 +2732,79 @@ bool translator::translate_instruction(const Instruction &inst,
       return false;
     }
 
-    if (exec_scope_cst->GetU32() != SpvScopeWorkgroup) {
-      std::cerr
-          << "UNIMPLEMENTED OpControlBarrier with non-workgroup execution scope"
-          << std::endl;
+    std::string fn;
+    switch (exec_scope_cst->GetU32()) {
+    case SpvScopeWorkgroup:
+      fn = m_clc_version >= 200 ? "work_group_barrier" : "barrier";
+      break;
+    case SpvScopeSubgroup:
+      fn = "sub_group_barrier";
+      break;
+    default:
+      std::cerr << "UNIMPLEMENTED OpControlBarrier with execution scope "
+                << exec_scope_cst->GetU32() << std::endl;
       return false;
     }
 
-    auto mem_scope_cst = cstmgr->FindDeclaredConstant(memory_scope);
-    if (mem_scope_cst == nullptr) {
+    auto mem_sem_cst = cstmgr->FindDeclaredConstant(memory_semantics);
+    if (mem_sem_cst == nullptr) {
       std::cerr
-          << "UNIMPLEMENTED OpControlBarrier with non-constant memory scope"
+          << "UNIMPLEMENTED OpControlBarrier with non-constant memory semantics"
           << std::endl;
       return false;
     }
 
-    std::string flags;
-    switch (mem_scope_cst->GetU32()) {
-    case SpvScopeWorkgroup:
-      flags = "CLK_LOCAL_MEM_FENCE";
-      break;
-    case SpvScopeDevice:
-      flags = "CLK_GLOBAL_MEM_FENCE";
-      break;
-    default:
-      std::cerr << "UNIMPLEMENTED memory scope in OpControlBarrier "
-                << memory_scope << std::endl;
-      return false;
+    // Only fence the memory the semantics ask for, a barrier without memory
+    // ordering only synchronises execution.
+    auto mem_sem = mem_sem_cst->GetU32();
+    std::string flags = "0";
+    if (mem_sem & gMemorySemanticsOrderingMask) {
+      flags = src_mem_fence_flags(mem_sem);
+    }
+
+    if (m_clc_version >= 200) {
+      std::string scope;
+      if (!get_memory_scope(memory_scope, scope)) {
+        return false;
+      }
+      src = src_function_call(fn, flags + ", " + scope);
+    } else {
+      src = src_function_call(fn, flags);
     }
+    break;
+  }
+  case spv::Op::OpMemoryBarrier: {
+    auto memory_scope = inst.GetSingleWordOperand(0);
+    auto memory_semantics = inst.GetSingleWordOperand(1);
+
+    auto cstmgr = m_ir->get_constant_mgr();
 
     auto mem_sem_cst = cstmgr->FindDeclaredConstant(memory_semantics);
     if (mem_sem_cst == nullptr) {
       std::cerr
-          << "UNIMPLEMENTED OpControlBarrier with non-constant memory semantics"
+          << "UNIMPLEMENTED OpMemoryBarrier with non-constant memory semantics"
           << std::endl;
       return false;
     }
 
+    // Nothing to do when no ordering or no memory is requested
     auto mem_sem = mem_sem_cst->GetU32();
-    if ((mem_sem != (SpvMemorySemanticsSequentiallyConsistentMask |
-                     SpvMemorySemanticsWorkgroupMemoryMask)) &&
-        (mem_sem != (SpvMemorySemanticsSequentiallyConsistentMask |
-                     SpvMemorySemanticsCrossWorkgroupMemoryMask))) {
-      std::cerr << "UNIMPLEMENTED OpControlBarrier with memory semantics "
-                << mem_sem << std::endl;
-      return false;
+    auto flags = src_mem_fence_flags(mem_sem);
+    if (((mem_sem & gMemorySemanticsOrderingMask) == 0) || (flags == "0")) {
+      break;
     }
 
-    src = src_function_call("barrier", flags);
+    if (m_clc_version >= 200) {
+      std::string order, scope;
+      if (!get_memory_order(memory_semantics, order) ||
+          !get_memory_scope(memory_scope, scope)) {
+        return false;
+      }
+      src = src_function_call("atomic_work_item_fence",
+                              flags + ", " + order + ", " + scope);
+    } else {
+      src = src_function_call("mem_fence", flags);
+    }
     break;
   }
   case spv::Op::OpGroupAsyncCopy: {
@@ -1478,6 +2870,129 @@ bool translator::translate_instruction(const Instruction &inst,
     assign_result = false;
     break;
   }
+  case spv::Op::OpGroupAll:
+  case spv::Op::OpGroupAny: {
+    auto execution_scope = inst.GetSingleWordOperand(2);
+    auto predicate = inst.GetSingleWordOperand(3);
+    std::string prefix;
+    if (!get_group_prefix(execution_scope, prefix)) {
+      return false;
+    }
+    auto fn = opcode == spv::Op::OpGroupAll ? "all" : "any";
+    sval = src_function_call(prefix + fn, predicate);
+    break;
+  }
+  case spv::Op::OpGroupBroadcast: {
+    auto execution_scope = inst.GetSingleWordOperand(2);
+    auto value = inst.GetSingleWordOperand(3);
+    auto local_id = inst.GetSingleWordOperand(4);
+    std::string prefix;
+    if (!get_group_prefix(execution_scope, prefix)) {
+      return false;
+    }
+    std::string args = var_for(value);
+    auto local_id_type = type_for_val(local_id);
+    if (local_id_type->kind() == Type::Kind::kVector) {
+      auto ncomp = local_id_type->AsVector()->element_count();
+      for (unsigned i = 0; i < ncomp; i++) {
+        args += ", " + src_vec_comp(local_id, i);
+      }
+    } else {
+      args += ", " + var_for(local_id);
+    }
+    sval = src_function_call(prefix + "broadcast", args);
+    break;
+  }
+  case spv::Op::OpGroupIAdd:
+  case spv::Op::OpGroupFAdd:
+  case spv::Op::OpGroupFMin:
+  case spv::Op::OpGroupUMin:
+  case spv::Op::OpGroupSMin:
+  case spv::Op::OpGroupFMax:
+  case spv::Op::OpGroupUMax:
+  case spv::Op::OpGroupSMax: {
+    static std::unordered_map<spv::Op, std::pair<const std::string, bool>> fns{
+        {spv::Op::OpGroupIAdd, {"add", false}},
+        {spv::Op::OpGroupFAdd, {"add", false}},
+        {spv::Op::OpGroupFMin, {"min", false}},
+        {spv::Op::OpGroupUMin, {"min", false}},
+        {spv::Op::OpGroupSMin, {"min", true}},
+        {spv::Op::OpGroupFMax, {"max", false}},
+        {spv::Op::OpGroupUMax, {"max", false}},
+        {spv::Op::OpGroupSMax, {"max", true}},
+    };
+    auto execution_scope = inst.GetSingleWordOperand(2);
+    auto operation = inst.GetSingleWordOperand(3);
+    auto x = inst.GetSingleWordOperand(4);
+    std::string fn;
+    if (!get_group_prefix(execution_scope, fn)) {
+      return false;
+    }
+    switch (operation) {
+    case SpvGroupOperationReduce:
+      fn += "reduce_";
+      break;
+    case SpvGroupOperationInclusiveScan:
+      fn += "scan_inclusive_";
+      break;
+    case SpvGroupOperationExclusiveScan:
+      fn += "scan_exclusive_";
+      break;
+    default:
+      std::cerr << "UNIMPLEMENTED group operation " << operation << std::endl;
+      return false;
+    }
+    auto &fn_signed = fns.at(opcode);
+    fn += fn_signed.first;
+    if (fn_signed.second) {
+      sval = src_as_result(rtype, src_function_call_signed(fn, x));
+    } else {
+      sval = src_function_call(fn, x);
+    }
+    break;
+  }
+  case spv::Op::OpSubgroupShuffleINTEL: {
+    auto data = inst.GetSingleWordOperand(2);
+    auto invocation_id = inst.GetSingleWordOperand(3);
+    sval = src_function_call("intel_sub_group_shuffle", data, invocation_id);
+    break;
+  }
+  case spv::Op::OpSubgroupShuffleDownINTEL: {
+    auto current = inst.GetSingleWordOperand(2);
+    auto next = inst.GetSingleWordOperand(3);
+    auto delta = inst.GetSingleWordOperand(4);
+    sval = src_function_call("intel_sub_group_shuffle_down", current, next,
+                             delta);
+    break;
+  }
+  case spv::Op::OpSubgroupShuffleUpINTEL: {
+    auto previous = inst.GetSingleWordOperand(2);
+    auto current = inst.GetSingleWordOperand(3);
+    auto delta = inst.GetSingleWordOperand(4);
+    sval = src_function_call("intel_sub_group_shuffle_up", previous, current,
+                             delta);
+    break;
+  }
+  case spv::Op::OpSubgroupShuffleXorINTEL: {
+    auto data = inst.GetSingleWordOperand(2);
+    auto value = inst.GetSingleWordOperand(3);
+    sval = src_function_call("intel_sub_group_shuffle_xor", data, value);
+    break;
+  }
+  case spv::Op::OpSubgroupBlockReadINTEL: {
+    auto ptr = inst.GetSingleWordOperand(2);
+    auto fn = src_subgroup_block_io("intel_sub_group_block_read", rtype);
+    sval = src_function_call(fn, ptr);
+    break;
+  }
+  case spv::Op::OpSubgroupBlockWriteINTEL: {
+    auto ptr = inst.GetSingleWordOperand(0);
+    auto data = inst.GetSingleWordOperand(1);
+    auto fn =
+        src_subgroup_block_io("intel_sub_group_block_write", type_id_for(data));
+    src = src_function_call(fn, ptr, data);
+    break;
+  }
   case spv::Op::OpExtInst: {
     assign_result = false;
     if (!translate_extended_instruction(inst, src)) {
@@ -1495,14 +3010,20 @@ bool translator::translate_instruction(const Instruction &inst,
   }
 
   if ((result != 0) && assign_result) {
-    src = src_var_decl(result);
-    src += " = " + sval;
+    if (is_inlinable_condition(inst)) {
+      m_literals[result] = "(" + sval + ")";
+    } else {
+      src = src_var_decl(result);
+      src += " = " + sval;
+    }
   }
 
   return true;
 }
 
 bool translator::translate_capabilities() {
+  bool intel_subgroups = false;
+  bool int64_atomics = false;
   for (auto &inst : m_ir->capabilities()) {
     assert(inst.opcode() == spv::Op::OpCapability);
     auto cap = inst.GetSingleWordOperand(0);
@@ -1517,6 +3038,13 @@ bool translator::translate_capabilities() {
     case SpvCapabilityImageBasic:
     case SpvCapabilityLiteralSampler:
     case SpvCapabilityFloat16Buffer:
+    case SpvCapabilitySubgroupDispatch:
+      break;
+    case SpvCapabilityGenericPointer:
+      if (m_clc_version < 200) {
+        std::cerr << "UNIMPLEMENTED generic pointers before OpenCL C 2.0.\n";
+        return false;
+      }
       break;
     case SpvCapabilityFloat16:
       m_src << "#pragma OPENCL EXTENSION cl_khr_fp16 : enable" << std::endl;
@@ -1524,20 +3052,147 @@ bool translator::translate_capabilities() {
     case SpvCapabilityFloat64:
       m_src << "#pragma OPENCL EXTENSION cl_khr_fp64 : enable" << std::endl;
       break;
+    case SpvCapabilityInt64Atomics:
+    case SpvCapabilityAtomicFloat64AddEXT:
+      // 64-bit floating-point atomics require the 64-bit integer atomics
+      // extensions as well
+      if (!int64_atomics) {
+        m_src << "#pragma OPENCL EXTENSION cl_khr_int64_base_atomics : enable"
+              << std::endl;
+        m_src << "#pragma OPENCL EXTENSION cl_khr_int64_extended_atomics : "
+                 "enable"
+              << std::endl;
+        int64_atomics = true;
+      }
+      break;
+    case SpvCapabilityAtomicFloat32AddEXT:
+      break;
+    case SpvCapabilityGroups:
+      // work_group_* collectives require OpenCL C 2.0 and are checked when
+      // translated, sub-group extensions are enabled below when used
+      break;
+    case SpvCapabilitySubgroupShuffleINTEL:
+    case SpvCapabilitySubgroupBufferBlockIOINTEL:
+      if (!intel_subgroups) {
+        m_src << "#pragma OPENCL EXTENSION cl_intel_subgroups : enable"
+              << std::endl;
+        intel_subgroups = true;
+      }
+      break;
     default:
       std::cerr << "UNIMPLEMENTED capability " << cap << ".\n";
       return false;
     }
   }
+
+  bool subgroups;
+  std::set<uint32_t> intel_subgroup_widths;
+  scan_subgroup_usage(subgroups, intel_subgroup_widths);
+  if (subgroups) {
+    m_src << "#pragma OPENCL EXTENSION cl_khr_subgroups : enable" << std::endl;
+  }
+  for (auto width : intel_subgroup_widths) {
+    static const std::unordered_map<uint32_t, const char *> exts{
+        {8, "cl_intel_subgroups_char"},
+        {16, "cl_intel_subgroups_short"},
+        {64, "cl_intel_subgroups_long"},
+    };
+    if (exts.count(width)) {
+      m_src << "#pragma OPENCL EXTENSION " << exts.at(width) << " : enable"
+            << std::endl;
+    }
+  }
+
   return true;
 }
 
+void translator::scan_subgroup_usage(bool &subgroups,
+                                     std::set<uint32_t> &widths) const {
+  auto cstmgr = m_ir->get_constant_mgr();
+  auto is_subgroup_scope = [&](uint32_t scope) {
+    auto scope_cst = cstmgr->FindDeclaredConstant(scope);
+    return (scope_cst != nullptr) && (scope_cst->GetU32() == SpvScopeSubgroup);
+  };
+  auto add_width = [&](uint32_t tyid) {
+    const Type *type = type_for(tyid);
+    if (type->kind() == Type::Kind::kVector) {
+      type = type->AsVector()->element_type();
+    }
+    if (type->kind() == Type::Kind::kInteger) {
+      widths.insert(type->AsInteger()->width());
+    }
+  };
+
+  // Sub-group built-in variables are read with get_sub_group_* functions
+  subgroups = false;
+  for (auto &inst : m_ir->module()->annotations()) {
+    if ((inst.opcode() != spv::Op::OpDecorate) ||
+        (inst.GetSingleWordOperand(1) != SpvDecorationBuiltIn)) {
+      continue;
+    }
+    switch (inst.GetSingleWordOperand(2)) {
+    case SpvBuiltInSubgroupSize:
+    case SpvBuiltInSubgroupMaxSize:
+    case SpvBuiltInNumSubgroups:
+    case SpvBuiltInNumEnqueuedSubgroups:
+    case SpvBuiltInSubgroupId:
+    case SpvBuiltInSubgroupLocalInvocationId:
+      m_ir->get_def_use_mgr()->ForEachUser(
+          inst.GetSingleWordOperand(0), [&](Instruction *user) {
+            subgroups |= user->opcode() == spv::Op::OpLoad;
+          });
+      break;
+    default:
+      break;
+    }
+  }
+
+  for (auto &func : *m_ir->module()) {
+    for (auto &bb : func) {
+      for (auto &inst : bb) {
+        switch (inst.opcode()) {
+        case spv::Op::OpControlBarrier:
+          subgroups |= is_subgroup_scope(inst.GetSingleWordOperand(0));
+          break;
+        case spv::Op::OpGroupAll:
+        case spv::Op::OpGroupAny:
+        case spv::Op::OpGroupBroadcast:
+        case spv::Op::OpGroupIAdd:
+        case spv::Op::OpGroupFAdd:
+        case spv::Op::OpGroupFMin:
+        case spv::Op::OpGroupUMin:
+        case spv::Op::OpGroupSMin:
+        case spv::Op::OpGroupFMax:
+        case spv::Op::OpGroupUMax:
+        case spv::Op::OpGroupSMax:
+          subgroups |= is_subgroup_scope(inst.GetSingleWordOperand(2));
+          break;
+        case spv::Op::OpSubgroupShuffleINTEL:
+        case spv::Op::OpSubgroupShuffleDownINTEL:
+        case spv::Op::OpSubgroupShuffleUpINTEL:
+        case spv::Op::OpSubgroupShuffleXorINTEL:
+        case spv::Op::OpSubgroupBlockReadINTEL:
+          add_width(inst.type_id());
+          break;
+        case spv::Op::OpSubgroupBlockWriteINTEL:
+          add_width(type_id_for(inst.GetSingleWordOperand(1)));
+          break;
+        default:
+          break;
+        }
+      }
+    }
+  }
+}
+
 bool translator::translate_extensions() const {
   for (auto &inst : m_ir->module()->extensions()) {
     assert(inst.opcode() == spv::Op::OpExtension);
     auto &op_ext = inst.GetOperand(0);
     auto ext = op_ext.AsString();
-    if (ext != "SPV_KHR_no_integer_wrap_decoration") {
+    if ((ext != "SPV_KHR_no_integer_wrap_decoration") &&
+        (ext != "SPV_INTEL_subgroups") &&
+        (ext != "SPV_EXT_shader_atomic_float_add")) {
       std::cerr << "UNIMPLEMENTED extension " << ext << ".\n";
       return false;
     }
@@ -1604,6 +3259,26 @@ bool translator::translate_execution_modes() {
     case SpvExecutionModeContractionOff:
       m_entry_points_contraction_off.insert(ep);
       break;
+    case SpvExecutionModeLocalSizeHint: {
+      auto x = em.GetSingleWordOperand(2);
+      auto y = em.GetSingleWordOperand(3);
+      auto z = em.GetSingleWordOperand(4);
+      m_entry_points_local_size_hint[ep] = std::make_tuple(x, y, z);
+      break;
+    }
+    case SpvExecutionModeVecTypeHint: {
+      auto hint = em.GetSingleWordOperand(2);
+      auto type = vec_type_hint(hint);
+      if (type == "") {
+        std::cerr << "UNIMPLEMENTED vector type hint " << hint << ".\n";
+        return false;
+      }
+      m_entry_points_vec_type_hint[ep] = type;
+      break;
+    }
+    case SpvExecutionModeSubgroupSize:
+      m_entry_points_subgroup_size[ep] = em.GetSingleWordOperand(2);
+      break;
     default:
       std::cerr << "UNIMPLEMENTED execution mode " << mode << ".\n";
       return false;
@@ -1888,6 +3563,12 @@ bool translator::translate_annotations() {
         case SpvBuiltInLocalInvocationId:
         case SpvBuiltInNumWorkgroups:
         case SpvBuiltInWorkDim:
+        case SpvBuiltInSubgroupSize:
+        case SpvBuiltInSubgroupMaxSize:
+        case SpvBuiltInNumSubgroups:
+        case SpvBuiltInNumEnqueuedSubgroups:
+        case SpvBuiltInSubgroupId:
+        case SpvBuiltInSubgroupLocalInvocationId:
           m_builtin_variables[target] = static_cast<SpvBuiltIn>(builtin);
           break;
         default:
@@ -1911,7 +3592,9 @@ bool translator::translate_annotations() {
         m_packed.insert(target);
         break;
       case SpvDecorationNonReadable:
-      case SpvDecorationNonWritable: // TODO const?
+        break;
+      case SpvDecorationNonWritable:
+        m_nonwritables.insert(target);
         break;
       case SpvDecorationAlignment: {
         auto align = inst.GetSingleWordOperand(2);
@@ -1960,6 +3643,7 @@ bool translator::translate_annotations() {
       bool hasvolatile = m_volatiles.count(group) != 0;
       bool packed = m_packed.count(group) != 0;
       bool nowrite = m_nowrite_params.count(group) != 0;
+      bool nonwritable = m_nonwritables.count(group) != 0;
       bool saturated_conversion = m_saturated_conversions.count(group) != 0;
       bool has_rounding_mode = m_rounding_mode_decorations.count(group) != 0;
       SpvFPRoundingMode rounding_mode;
@@ -1985,6 +3669,9 @@ bool translator::translate_annotations() {
         if (nowrite) {
           m_nowrite_params.insert(target);
         }
+        if (nonwritable) {
+          m_nonwritables.insert(target);
+        }
         if (saturated_conversion) {
           m_saturated_conversions.insert(target);
         }
@@ -2006,38 +3693,52 @@ bool translator::translate_annotations() {
   return true;
 }
 
-std::string translator::src_pointer_type(uint32_t storage, uint32_t tyid, bool signedty) const {
-  std::string typestr;
-  if (type_for(tyid)->kind() == Type::Kind::kArray) {
-    auto tarray = type_for(tyid)->AsArray();
-    auto elemty = tarray->element_type();
-    typestr += src_type(type_id_for(elemty));
-  } else {
-    if (signedty) {
-        typestr += src_type_signed(tyid);
-    } else {
-        typestr += src_type(tyid);
-    }
-  }
-  typestr += " ";
+bool translator::get_address_space(uint32_t storage, std::string &src) const {
   switch (storage) {
   case SpvStorageClassCrossWorkgroup:
-    typestr += "global";
+    src = "global";
     break;
   case SpvStorageClassUniformConstant:
-    typestr += "constant";
+    src = "constant";
     break;
   case SpvStorageClassWorkgroup:
-    typestr += "local";
+    src = "local";
+    break;
+  case SpvStorageClassGeneric:
+    src = "generic";
     break;
   case SpvStorageClassInput:
   case SpvStorageClassFunction:
+    src = "";
     break;
   default:
     std::cerr << "UNIMPLEMENTED pointer storage class " << storage
               << std::endl;
+    return false;
+  }
+
+  return true;
+}
+
+std::string translator::src_pointer_type(uint32_t storage, uint32_t tyid, bool signedty) const {
+  std::string typestr;
+  if (type_for(tyid)->kind() == Type::Kind::kArray) {
+    uint32_t len;
+    auto elemty = array_type_get_flat_element(tyid, len);
+    typestr += src_type(type_id_for(elemty));
+  } else {
+    if (signedty) {
+        typestr += src_type_signed(tyid);
+    } else {
+        typestr += src_type(tyid);
+    }
+  }
+  typestr += " ";
+  std::string addrspace;
+  if (!get_address_space(storage, addrspace)) {
     return "UNIMPLEMENTED";
   }
+  typestr += addrspace;
 
   typestr += "*";
   return typestr;
@@ -2249,13 +3950,35 @@ bool translator::translate_types_values() {
       switch (type->kind()) {
       case Type::Kind::kInteger: {
         auto tint = type->AsInteger();
-        if (tint->width() <= 32) {
-          m_literals[result] = src_cast(rtype, std::to_string(op_val.words[0]));
+        // 32 and 64-bit constants are written with suffixes that give them
+        // the right type, narrower types have no suffix and need a cast
+        if (tint->width() < 32) {
+          uint32_t w = op_val.words[0];
+          int32_t sw = static_cast<int32_t>(w << (32 - tint->width())) >>
+                       (32 - tint->width());
+          m_literals[result] = src_cast(rtype, std::to_string(w));
+          m_signed_literals[result] =
+              src_cast_signed(rtype, std::to_string(sw));
+        } else if (tint->width() == 32) {
+          uint32_t w = op_val.words[0];
+          int32_t sw = static_cast<int32_t>(w);
+          m_literals[result] = std::to_string(w) + "u";
+          if (sw >= 0) {
+            m_signed_literals[result] = std::to_string(sw);
+          } else if (sw != std::numeric_limits<int32_t>::min()) {
+            m_signed_literals[result] = "(" + std::to_string(sw) + ")";
+          }
         } else if (tint->width() == 64) {
           uint64_t w0 = op_val.words[0];
           uint64_t w1 = op_val.words[1];
           auto w = w1 << 32 | w0;
-          m_literals[result] = src_cast(rtype, std::to_string(w));
+          int64_t sw = static_cast<int64_t>(w);
+          m_literals[result] = std::to_string(w) + "ul";
+          if (sw >= 0) {
+            m_signed_literals[result] = std::to_string(sw) + "l";
+          } else if (sw != std::numeric_limits<int64_t>::min()) {
+            m_signed_literals[result] = "(" + std::to_string(sw) + "l)";
+          }
         } else {
           std::cerr << "UNIMPLEMENTED integer constant width " << tint->width()
                     << std::endl;
@@ -2400,38 +4123,64 @@ bool translator::translate_types_values() {
         m_literals[result] = lit;
         break;
       }
-      case Type::Kind::kStruct: {
-        auto tstruct = type->AsStruct();
-        // ((type){m0, m1, ..., mN})
-        lit = "((" + src_type(rtype) + "){";
-        const char *sep = "";
-        for (uint32_t opidx = 2; opidx < tstruct->element_types().size() + 2;
-             opidx++) {
-          auto mid = inst.GetSingleWordOperand(opidx);
-          lit += sep;
-          lit += m_literals[mid];
-          sep = ", ";
-        }
-        lit += "})";
-        m_literals[result] = lit;
-        break;
-      }
+      case Type::Kind::kStruct:
       case Type::Kind::kArray: {
-        lit = "{";
-        const char *sep = "";
-        uint32_t num_elems = array_type_get_length(rtype);
-        if (num_elems == 0) {
-            return false;
+        if ((type->kind() == Type::Kind::kArray) &&
+            (array_type_get_length(rtype) == 0)) {
+          return false;
         }
-
-        for (uint32_t opidx = 2; opidx < num_elems + 2; opidx++) {
+        // {m0, m1, ..., mN}
+        bool nested = (type->kind() == Type::Kind::kArray) &&
+                      (type->AsArray()->element_type()->kind() ==
+                       Type::Kind::kArray);
+        std::string init = "{";
+        const char *sep = "";
+        for (uint32_t opidx = 2; opidx < inst.NumOperands(); opidx++) {
           auto mid = inst.GetSingleWordOperand(opidx);
-          lit += sep;
-          lit += m_literals[mid];
+          init += sep;
           sep = ", ";
+          if (!nested) {
+            init += src_initializer(mid);
+            continue;
+          }
+          // Nested arrays are flattened, splice the elements in
+          if (m_constant_initializers.count(mid)) {
+            auto &minit = m_constant_initializers.at(mid);
+            init += minit.substr(1, minit.size() - 2);
+          } else {
+            uint32_t len;
+            auto elemty = array_type_get_flat_element(type_id_for(mid), len);
+            std::string null;
+            if (!get_null_constant(type_id_for(elemty), null)) {
+              return false;
+            }
+            for (uint32_t j = 0; j < len; j++) {
+              init += (j == 0 ? "" : ", ") + null;
+            }
+          }
+        }
+        init += "}";
+        m_constant_initializers[result] = init;
+
+        // Large constants are emitted once as a program-scope table rather
+        // than being expanded at each use. Identical tables are shared.
+        if (type_size(rtype) >= gConstantTableMinSize) {
+          auto decl = src_type_memory_object_declaration(rtype, 0, "");
+          auto key = decl + " = " + init;
+          if (m_constant_tables.count(key) == 0) {
+            auto name = var_for(result);
+            m_src << "constant "
+                  << src_type_memory_object_declaration(rtype, result, name)
+                  << " = " << init << ";" << std::endl;
+            m_constant_tables[key] = name;
+          }
+          m_literals[result] = m_constant_tables.at(key);
+        } else if (type->kind() == Type::Kind::kStruct) {
+          // ((type){m0, m1, ..., mN})
+          m_literals[result] = "((" + src_type(rtype) + ")" + init + ")";
+        } else {
+          m_literals[result] = init;
         }
-        lit += "}";
-        m_literals[result] = lit;
         break;
       }
       default:
@@ -2464,11 +4213,23 @@ bool translator::translate_types_values() {
         std::string local_var_decl = "local " + src_type_memory_object_declaration(typointeeid, result);
         m_local_variable_decls[result] = local_var_decl;
       } else if (storage == SpvStorageClassUniformConstant) {
+        // Variables initialised with a constant table can use the table
+        // directly.
+        if ((inst.NumOperands() > 3) && (m_exports.count(result) == 0) &&
+            (m_volatiles.count(result) == 0) &&
+            (m_alignments.count(result) == 0)) {
+          auto init = inst.GetSingleWordOperand(3);
+          if (m_constant_initializers.count(init) &&
+              (type_size(typointeeid) >= gConstantTableMinSize)) {
+            m_literals[result] = var_for(init);
+            break;
+          }
+        }
         m_src << "constant "
               << src_type_memory_object_declaration(typointeeid, result);
         if (inst.NumOperands() > 3) {
           auto init = inst.GetSingleWordOperand(3);
-          m_src << " = " << var_for(init);
+          m_src << " = " << src_initializer(init);
         }
         m_src << ";" << std::endl;
       } else {
@@ -2487,12 +4248,149 @@ bool translator::translate_types_values() {
   return true;
 }
 
+std::string translator::src_as_result(uint32_t dtyid,
+                                      const std::string &src) const {
+  if (type_for(dtyid)->kind() == Type::Kind::kVector) {
+    return src_as(dtyid, src);
+  }
+  return src;
+}
+
+bool translator::can_promote_to_constant(
+    uint32_t val, std::vector<uint32_t> &derived) const {
+  auto ptrty = type_for_val(val)->AsPointer();
+  if ((ptrty == nullptr) || (static_cast<uint32_t>(ptrty->storage_class()) !=
+                             SpvStorageClassCrossWorkgroup)) {
+    return false;
+  }
+  derived.push_back(val);
+
+  // Pointers to the constant address space can't be converted to pointers to
+  // other address spaces so only accept uses that load through the pointer
+  // or derive new pointers that can themselves be promoted.
+  bool promotable = true;
+  auto defuse = m_ir->get_def_use_mgr();
+  defuse->ForEachUser(val, [&](Instruction *user) {
+    if (!promotable) {
+      return;
+    }
+    switch (user->opcode()) {
+    case spv::Op::OpName:
+    case spv::Op::OpDecorate:
+    case spv::Op::OpGroupDecorate:
+    case spv::Op::OpLoad:
+      break;
+    case spv::Op::OpAccessChain:
+    case spv::Op::OpInBoundsAccessChain:
+    case spv::Op::OpPtrAccessChain:
+    case spv::Op::OpInBoundsPtrAccessChain:
+      promotable = (user->GetSingleWordOperand(2) == val) &&
+                   can_promote_to_constant(user->result_id(), derived);
+      break;
+    case spv::Op::OpBitcast:
+    case spv::Op::OpCopyObject:
+      promotable = can_promote_to_constant(user->result_id(), derived);
+      break;
+    case spv::Op::OpExtInst:
+      switch (user->GetSingleWordOperand(3)) {
+      case OpenCLLIB::Vloadn:
+      case OpenCLLIB::Vload_half:
+      case OpenCLLIB::Vload_halfn:
+      case OpenCLLIB::Vloada_halfn:
+        break;
+      default:
+        promotable = false;
+        break;
+      }
+      break;
+    default:
+      promotable = false;
+      break;
+    }
+  });
+
+  return promotable;
+}
+
+void translator::promote_constant_args(Function &func) {
+  auto &kernel = m_entry_points.at(func.result_id());
+  if (m_constant_promotions.count(kernel) == 0) {
+    return;
+  }
+  auto &allowed = m_constant_promotions.at(kernel);
+
+  // Callers of the kernel would pass global pointers to the promoted
+  // parameters
+  bool called = false;
+  m_ir->get_def_use_mgr()->ForEachUser(
+      func.result_id(), [&called](Instruction *user) {
+        called |= user->opcode() == spv::Op::OpFunctionCall;
+      });
+  if (called) {
+    return;
+  }
+
+  uint32_t index = 0;
+  uint32_t num_promoted = 0;
+  uint64_t total_size = 0;
+  func.ForEachParam([&](const Instruction *inst) {
+    auto arg = index++;
+    auto result = inst->result_id();
+    if ((allowed.count(arg) == 0) || ((m_nowrite_params.count(result) == 0) &&
+                                      (m_nonwritables.count(result) == 0))) {
+      return;
+    }
+    auto size = allowed.at(arg);
+    if ((m_constant_max_args != 0) && (num_promoted >= m_constant_max_args)) {
+      return;
+    }
+    if ((m_constant_max_size != 0) &&
+        ((size == 0) || (total_size + size > m_constant_max_size))) {
+      return;
+    }
+    std::vector<uint32_t> derived;
+    if (!can_promote_to_constant(result, derived)) {
+      return;
+    }
+    for (auto val : derived) {
+      auto ptrty = type_for_val(val)->AsPointer();
+      auto pointeeid = type_id_for(ptrty->pointee_type());
+      m_constant_pointer_types[val] =
+          src_pointer_type(SpvStorageClassUniformConstant, pointeeid, false);
+    }
+    num_promoted++;
+    total_size += size;
+    m_constant_args[kernel].push_back(arg);
+  });
+}
+
 bool translator::translate_function(Function &func) {
   auto &dinst = func.DefInst();
   auto rtype = dinst.type_id();
   auto result = dinst.result_id();
   auto control = dinst.GetSingleWordOperand(2);
 
+  // Branch weights are translated to hints when the compiler supports them
+  if (!m_branch_hint_macro) {
+    for (auto &bb : func) {
+      auto &term = *bb.ctail();
+      if ((term.opcode() == spv::Op::OpBranchConditional) &&
+          (term.NumOperands() == 5)) {
+        m_src << "#if defined(__has_builtin)" << std::endl;
+        m_src << "#if __has_builtin(__builtin_expect)" << std::endl;
+        m_src << "#define SPIRV2CLC_EXPECT(x, v) __builtin_expect((x), (v))"
+              << std::endl;
+        m_src << "#endif" << std::endl;
+        m_src << "#endif" << std::endl;
+        m_src << "#ifndef SPIRV2CLC_EXPECT" << std::endl;
+        m_src << "#define SPIRV2CLC_EXPECT(x, v) (x)" << std::endl;
+        m_src << "#endif" << std::endl;
+        m_branch_hint_macro = true;
+        break;
+      }
+    }
+  }
+
   bool decl = false;
   bool entrypoint = m_entry_points.count(result) != 0;
 
@@ -2511,8 +4409,34 @@ bool translator::translate_function(Function &func) {
     m_src << "inline ";
   }
 
+  // Kernels are never inlined, only carry over the controls for functions
+  if (!entrypoint) {
+    std::vector<std::string> attributes;
+    if (control & SpvFunctionControlInlineMask) {
+      attributes.push_back("always_inline");
+    }
+    if (control & SpvFunctionControlDontInlineMask) {
+      attributes.push_back("noinline");
+    }
+    if (control & SpvFunctionControlConstMask) {
+      attributes.push_back("const");
+    } else if (control & SpvFunctionControlPureMask) {
+      attributes.push_back("pure");
+    }
+    if (!attributes.empty()) {
+      m_src << "__attribute__((";
+      const char *sep = "";
+      for (auto &attr : attributes) {
+        m_src << sep << attr;
+        sep = ", ";
+      }
+      m_src << ")) ";
+    }
+  }
+
   m_src << src_type(rtype) + " ";
   if (entrypoint) {
+    promote_constant_args(func);
     m_src << "kernel ";
     if (m_entry_points_local_size.count(result)) {
       auto &req = m_entry_points_local_size.at(result);
@@ -2521,6 +4445,32 @@ bool translator::translate_function(Function &func) {
             << std::get<2>(req);
       m_src << "))) ";
     }
+    if (m_entry_points_local_size_hint.count(result)) {
+      auto &hint = m_entry_points_local_size_hint.at(result);
+      m_src << "__attribute((work_group_size_hint(";
+      m_src << std::get<0>(hint) << "," << std::get<1>(hint) << ","
+            << std::get<2>(hint);
+      m_src << "))) ";
+    }
+    if (m_entry_points_vec_type_hint.count(result)) {
+      m_src << "__attribute((vec_type_hint(";
+      m_src << m_entry_points_vec_type_hint.at(result);
+      m_src << "))) ";
+    }
+    // There is no core OpenCL C attribute to require a sub-group size. The
+    // kernel can't run as required without the Intel extension, fail the
+    // build rather than drop the requirement.
+    if (m_entry_points_subgroup_size.count(result)) {
+      m_src << std::endl;
+      m_src << "#ifdef cl_intel_required_subgroup_size" << std::endl;
+      m_src << "__attribute((intel_reqd_sub_group_size(";
+      m_src << m_entry_points_subgroup_size.at(result);
+      m_src << ")))" << std::endl;
+      m_src << "#else" << std::endl;
+      m_src << "#error \"" << m_entry_points.at(result)
+            << " requires cl_intel_required_subgroup_size\"" << std::endl;
+      m_src << "#endif" << std::endl;
+    }
     m_src << m_entry_points.at(result);
   } else {
     m_src << var_for(result);
@@ -2531,7 +4481,8 @@ bool translator::translate_function(Function &func) {
     auto type = inst->type_id();
     auto result = inst->result_id();
     m_src << sep;
-    if (m_nowrite_params.count(result)) {
+    if (m_nowrite_params.count(result) &&
+        (m_constant_pointer_types.count(result) == 0)) {
       m_src << "const ";
     }
     m_src << src_type_memory_object_declaration(type, result);
@@ -2709,11 +4660,10 @@ int translator::translate() {
   return 0;
 }
 
-bool translator::validate_module(const std::vector<uint32_t> &binary) const {
+bool translator::validate_module(const uint32_t *words, size_t count) const {
   spv_diagnostic diag;
   spv_context ctx = spvContextCreate(m_target_env);
-  spv_result_t res =
-      spvValidateBinary(ctx, binary.data(), binary.size(), &diag);
+  spv_result_t res = spvValidateBinary(ctx, words, count, &diag);
   spvDiagnosticPrint(diag);
   spvDiagnosticDestroy(diag);
   if (res != SPV_SUCCESS) {
@@ -2729,7 +4679,7 @@ int translator::translate(const std::string &assembly, std::string *srcout) {
 
   std::vector<uint32_t> module_bin;
   m_ir->module()->ToBinary(&module_bin, false);
-  if (!validate_module(module_bin)) {
+  if (!validate_module(module_bin.data(), module_bin.size())) {
     return 1;
   }
 
@@ -2744,11 +4694,15 @@ int translator::translate(const std::string &assembly, std::string *srcout) {
 
 int translator::translate(const std::vector<uint32_t> &binary,
                           std::string *srcout) {
+  return translate(binary.data(), binary.size(), srcout);
+}
+
+int translator::translate(const uint32_t *words, size_t count,
+                          std::string *srcout) {
 
-  m_ir = BuildModule(m_target_env, spvtools_message_consumer,
-                     binary.data(), binary.size());
+  m_ir = BuildModule(m_target_env, spvtools_message_consumer, words, count);
 
-  if (!validate_module(binary)) {
+  if (!validate_module(words, count)) {
     return 1;
   }
 
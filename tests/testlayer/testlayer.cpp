@@ -12,27 +12,37 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <filesystem>
 #include <fstream>
+#include <functional>
 #include <iostream>
-#include <sstream>
+#include <mutex>
+#include <queue>
+#include <shared_mutex>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 
 #include <dlfcn.h>
+#include <link.h>
 
-#ifdef __APPLE__
 #include <unistd.h>
-#endif
 
 #define CL_TARGET_OPENCL_VERSION 120
 #include <CL/cl.h>
 
+#include "spirv2clc.h"
+
 static const std::string CLANG{"clang"};
 static const std::string LLVMSPIRV{"llvm-spirv"};
-static const std::string SPIRV2CLC{"spirv2clc"};
 
 static decltype(&clCreateProgramWithSource) fnCreateProgramWithSource;
 static decltype(&clRetainProgram) fnRetainProgram;
@@ -46,6 +56,10 @@ static decltype(&clCreateKernel) fnCreateKernel;
 static decltype(&clCreateKernelsInProgram) fnCreateKernelsInProgram;
 static decltype(&clGetKernelInfo) fnGetKernelInfo;
 
+static std::filesystem::path gCacheDir;
+static bool gCacheBinaries;
+static std::string gTraceFile;
+
 static struct init {
   init() {
 #define LOAD_SYM(X) reinterpret_cast<decltype(&X)>(dlsym(RTLD_NEXT, #X))
@@ -61,12 +75,25 @@ static struct init {
     fnCreateKernelsInProgram = LOAD_SYM(clCreateKernelsInProgram);
     fnGetKernelInfo = LOAD_SYM(clGetKernelInfo);
 #undef LOAD_SYM
+
+    if (const char *dir = getenv("SPIRV2CLC_CACHE_DIR")) {
+      std::error_code ec;
+      std::filesystem::create_directories(dir, ec);
+      if (!ec) {
+        gCacheDir = dir;
+      }
+    }
+    gCacheBinaries = getenv("SPIRV2CLC_CACHE_BINARIES") != nullptr;
+    if (const char *trace = getenv("SPIRV2CLC_TRACE")) {
+      gTraceFile = trace;
+    }
   }
 } gInit;
 
 struct mock_program {
   mock_program(cl_context context, const std::string &&src)
-      : m_context(context), m_src(src), m_build_status(CL_BUILD_NONE) {
+      : m_context(context), m_src(src), m_build_status(CL_BUILD_NONE),
+        m_driver_build(false) {
     clRetainContext(m_context);
   }
 
@@ -75,18 +102,65 @@ struct mock_program {
   cl_context context() const { return m_context; }
   const std::string &src() const { return m_src; }
   cl_build_status build_status() const { return m_build_status; }
-  void set_build_status(cl_build_status status) { m_build_status = status; }
+  void set_build_status(cl_build_status status) {
+    std::lock_guard<std::mutex> lock(m_lock);
+    m_build_status = status;
+  }
+  // Marks the program as being built, fails if a build is already in
+  // progress. Queries are answered by the layer until the driver build starts.
+  bool begin_build() {
+    std::lock_guard<std::mutex> lock(m_lock);
+    if (m_build_status == CL_BUILD_IN_PROGRESS) {
+      return false;
+    }
+    m_build_status = CL_BUILD_IN_PROGRESS;
+    m_driver_build = false;
+    return true;
+  }
+  bool driver_build() const { return m_driver_build; }
+  void set_driver_build() { m_driver_build = true; }
   const std::string &build_log() const { return m_build_log; }
+  const std::string &cache_key() const { return m_cache_key; }
+  void set_cache_key(const std::string &key) { m_cache_key = key; }
+  const std::string &build_options() const { return m_build_options; }
+  void set_build_options(const std::string &options) {
+    m_build_options = options;
+  }
 
 private:
   cl_context m_context;
   std::string m_src;
-  cl_build_status m_build_status;
+  std::mutex m_lock;
+  std::atomic<cl_build_status> m_build_status;
+  std::atomic<bool> m_driver_build;
   std::string m_build_log;
+  std::string m_cache_key;
+  std::string m_build_options;
 };
 
+// Programs are looked up far more often than they are created or built so the
+// map is guarded by a reader-writer lock. The lock is never held while
+// compiling, builds of different programs run in parallel.
+static std::shared_mutex gProgramMapLock;
 static std::unordered_map<mock_program *, cl_program> gProgramMap;
 
+// Looks up the driver program for a program created by the layer. Returns
+// false for programs the layer doesn't know about.
+static bool find_program(mock_program *prog, cl_program *real) {
+  std::shared_lock<std::shared_mutex> lock(gProgramMapLock);
+  auto it = gProgramMap.find(prog);
+  if (it == gProgramMap.end()) {
+    return false;
+  }
+  *real = it->second;
+  return true;
+}
+
+static void set_program(mock_program *prog, cl_program real) {
+  std::unique_lock<std::shared_mutex> lock(gProgramMapLock);
+  gProgramMap[prog] = real;
+}
+
 cl_program CL_API_CALL clCreateProgramWithSource(cl_context context,
                                                  cl_uint count,
                                                  const char **strings,
@@ -105,7 +179,7 @@ cl_program CL_API_CALL clCreateProgramWithSource(cl_context context,
   }
 
   auto prog = new mock_program(context, std::move(src));
-  gProgramMap[prog] = nullptr;
+  set_program(prog, nullptr);
   if (errcode_ret != nullptr) {
     *errcode_ret = CL_SUCCESS;
   }
@@ -115,29 +189,23 @@ cl_program CL_API_CALL clCreateProgramWithSource(cl_context context,
 
 cl_int CL_API_CALL clRetainProgram(cl_program program) {
   auto prog = reinterpret_cast<mock_program *>(program);
-  if (gProgramMap.count(prog)) {
-    program = gProgramMap.at(prog);
-    if (program == nullptr) {
-      return CL_SUCCESS;
-    }
+  if (find_program(prog, &program) && (program == nullptr)) {
+    return CL_SUCCESS;
   }
   return fnRetainProgram(program);
 }
 
 cl_int CL_API_CALL clReleaseProgram(cl_program program) {
   auto prog = reinterpret_cast<mock_program *>(program);
-  if (gProgramMap.count(prog)) {
-    program = gProgramMap.at(prog);
-    if (program == nullptr) {
-      return CL_SUCCESS;
-    }
+  if (find_program(prog, &program) && (program == nullptr)) {
+    return CL_SUCCESS;
   }
   return fnReleaseProgram(program);
 }
 
 static bool save_string_to_file(const std::string &fname,
                                 const std::string &text) {
-  std::ofstream ofile{fname};
+  std::ofstream ofile{fname, std::ios::binary};
 
   if (!ofile.is_open()) {
     return false;
@@ -149,45 +217,443 @@ static bool save_string_to_file(const std::string &fname,
   return ofile.good();
 }
 
+static bool read_string_from_file(const std::string &fname,
+                                  std::string &text) {
+  std::ifstream ifile{fname, std::ios::binary | std::ios::ate};
+
+  if (!ifile.is_open()) {
+    return false;
+  }
+
+  auto size = ifile.tellg();
+  ifile.seekg(0, std::ios::beg);
+  text.resize(size);
+  ifile.read(&text[0], text.size());
+
+  return ifile.good();
+}
+
 std::ostream &log() {
   std::cout << "[SPIR2CL] ";
   return std::cout;
 }
 
-static cl_program compile(mock_program *program, cl_uint num_devices,
-                          const cl_device_id *device_list, const char *options,
-                          cl_uint num_input_headers = 0,
-                          const cl_program *input_headers = nullptr,
-                          const char **header_include_names = nullptr) {
-  auto clprog = reinterpret_cast<cl_program>(program);
-  // Store source to temporary file
-  char tmp_template[] = "spirv2clc-XXXXXX";
-  const char *tmp = mkdtemp(tmp_template);
-  if (tmp == nullptr) {
-    return nullptr;
+struct trace_event {
+  const char *name;
+  const void *program;
+  uint32_t tid;
+  int64_t start;
+  int64_t duration;
+};
+
+static std::mutex gTraceLock;
+static std::vector<trace_event> gTraceEvents;
+
+// Writes the recorded events as a Chrome trace at exit
+static struct trace_writer {
+  ~trace_writer() {
+    if (gTraceFile.empty()) {
+      return;
+    }
+
+    std::ofstream ofile{gTraceFile};
+    if (!ofile.is_open()) {
+      return;
+    }
+
+    auto pid = getpid();
+    ofile << "{\"traceEvents\":[";
+    const char *sep = "\n";
+    for (auto &event : gTraceEvents) {
+      ofile << sep << "{\"name\":\"" << event.name
+            << "\",\"cat\":\"spirv2clc\",\"ph\":\"X\",\"ts\":" << event.start
+            << ",\"dur\":" << event.duration << ",\"pid\":" << pid
+            << ",\"tid\":" << event.tid << ",\"args\":{\"program\":\""
+            << event.program << "\"}}";
+      sep = ",\n";
+    }
+    ofile << "\n]}\n";
+  }
+} gTraceWriter;
+
+static uint32_t trace_thread_id() {
+  static std::atomic<uint32_t> next_id{0};
+  thread_local uint32_t id = next_id++;
+  return id;
+}
+
+// Times a stage of a program's build. The duration is logged and recorded
+// for the trace when the timer is stopped or goes out of scope.
+class stage_timer {
+public:
+  stage_timer(const char *name, const void *program)
+      : m_name(name), m_program(program),
+        m_start(std::chrono::steady_clock::now()), m_stopped(false) {}
+
+  ~stage_timer() { stop(); }
+
+  void stop() {
+    if (m_stopped) {
+      return;
+    }
+    m_stopped = true;
+
+    auto end = std::chrono::steady_clock::now();
+    auto to_us = [](auto duration) {
+      return std::chrono::duration_cast<std::chrono::microseconds>(duration)
+          .count();
+    };
+    auto duration = to_us(end - m_start);
+    log() << m_name << " took " << duration / 1000.0 << " ms" << std::endl;
+
+    if (gTraceFile.empty()) {
+      return;
+    }
+    std::lock_guard<std::mutex> lock(gTraceLock);
+    gTraceEvents.push_back({m_name, m_program, trace_thread_id(),
+                            to_us(m_start.time_since_epoch()), duration});
+  }
+
+private:
+  const char *m_name;
+  const void *m_program;
+  std::chrono::steady_clock::time_point m_start;
+  bool m_stopped;
+};
+
+// Scratch space for the files the toolchain needs, on memory-backed storage
+// when available. The directory is removed when the build is done.
+class scratch_dir {
+public:
+  scratch_dir() {
+    std::error_code ec;
+    std::filesystem::path base{"/dev/shm"};
+    if (!std::filesystem::is_directory(base, ec)) {
+      base = std::filesystem::temp_directory_path(ec);
+      if (ec) {
+        return;
+      }
+    }
+    auto tmp_template = (base / "spirv2clc-XXXXXX").string();
+    if (mkdtemp(&tmp_template[0]) != nullptr) {
+      m_path = tmp_template;
+    }
+  }
+
+  ~scratch_dir() {
+    if (valid()) {
+      std::error_code ec;
+      std::filesystem::remove_all(m_path, ec);
+    }
+  }
+
+  bool valid() const { return !m_path.empty(); }
+  const std::filesystem::path &path() const { return m_path; }
+
+private:
+  std::filesystem::path m_path;
+};
+
+// Runs a shell command and captures its standard output
+static bool read_command_output(const std::string &cmd, std::string &output) {
+  FILE *pipe = popen(cmd.c_str(), "r");
+  if (pipe == nullptr) {
+    return false;
+  }
+
+  char buffer[65536];
+  size_t size;
+  while ((size = fread(buffer, 1, sizeof(buffer), pipe)) > 0) {
+    output.append(buffer, size);
+  }
+
+  return pclose(pipe) == 0;
+}
+
+// Appends a length-prefixed field to a cache key so that fields can't run
+// into each other.
+static void add_key_field(std::string &key, const std::string &field) {
+  key += std::to_string(field.size());
+  key += ':';
+  key += field;
+}
+
+// FNV-1a, the full key is stored alongside each entry to detect collisions.
+static std::string cache_hash(const std::string &key) {
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (unsigned char c : key) {
+    hash ^= c;
+    hash *= 0x100000001b3ull;
+  }
+  char hex[17];
+  snprintf(hex, sizeof(hex), "%016llx", static_cast<unsigned long long>(hash));
+  return hex;
+}
+
+static bool cache_load(const std::string &key, const std::string &ext,
+                       std::string &data) {
+  if (gCacheDir.empty()) {
+    return false;
+  }
+
+  auto base = (gCacheDir / cache_hash(key)).string();
+  std::string stored_key;
+  if (!read_string_from_file(base + ".key", stored_key) ||
+      (stored_key != key)) {
+    return false;
+  }
+
+  return read_string_from_file(base + ext, data);
+}
+
+// Entries may be shared by concurrent processes. Files are written under a
+// unique name and renamed into place, the key last.
+static void cache_store(const std::string &key, const std::string &ext,
+                        const std::string &data) {
+  if (gCacheDir.empty()) {
+    return;
   }
 
-  std::filesystem::path tmp_folder{tmp};
-  log() << "Created folder " << tmp_folder.string() << std::endl;
+  auto base = (gCacheDir / cache_hash(key)).string();
+  auto tmp = "." + std::to_string(getpid()) + "." +
+             std::to_string(std::hash<std::thread::id>{}(
+                 std::this_thread::get_id()));
+  std::error_code ec;
+  for (auto &file : {std::make_pair(ext, &data),
+                     std::make_pair(std::string{".key"}, &key)}) {
+    auto fname = base + file.first;
+    if (!save_string_to_file(fname + tmp, *file.second)) {
+      std::filesystem::remove(fname + tmp, ec);
+      return;
+    }
+    std::filesystem::rename(fname + tmp, fname, ec);
+    if (ec) {
+      return;
+    }
+  }
+}
+
+static void add_file_identity(std::string &key, const char *fname) {
+  std::error_code ec;
+  std::filesystem::path path{fname};
+  auto size = std::filesystem::file_size(path, ec);
+  auto mtime = std::filesystem::last_write_time(path, ec);
+  add_key_field(key, path.string());
+  add_key_field(key, std::to_string(size));
+  add_key_field(key, std::to_string(mtime.time_since_epoch().count()));
+}
 
-  std::filesystem::path src_file{tmp_folder / "original.cl"};
+// Identifies the toolchain and the builds of the layer and translator library.
+// Entries produced by another version of any of them are not reused. Computed
+// once per process.
+static const std::string &toolchain_id() {
+  static const std::string id = [] {
+    std::string id;
+    for (auto &tool : {CLANG, LLVMSPIRV}) {
+      std::string version;
+      if (!read_command_output(tool + " --version", version)) {
+        version.clear();
+      }
+      add_key_field(id, version);
+    }
+    Dl_info info;
+    if ((dladdr(&gInit, &info) != 0) && (info.dli_fname != nullptr)) {
+      add_file_identity(id, info.dli_fname);
+    }
+    // The translator is part of the layer unless built as a shared library
+    dl_iterate_phdr(
+        [](struct dl_phdr_info *info, size_t, void *data) {
+          if ((info->dlpi_name != nullptr) &&
+              (strstr(info->dlpi_name, "libspirv2clc") != nullptr)) {
+            add_file_identity(*static_cast<std::string *>(data),
+                              info->dlpi_name);
+          }
+          return 0;
+        },
+        &id);
+    return id;
+  }();
+  return id;
+}
+
+// Binaries depend on the device and driver on top of the translated source.
+static bool device_cache_key(mock_program *program, cl_device_id device,
+                             std::string &key) {
+  key = program->cache_key();
+  for (auto param : {CL_DEVICE_NAME, CL_DEVICE_VERSION, CL_DRIVER_VERSION}) {
+    size_t size;
+    cl_int err = clGetDeviceInfo(device, param, 0, nullptr, &size);
+    if (err != CL_SUCCESS) {
+      return false;
+    }
+    std::string value(size, '\0');
+    err = clGetDeviceInfo(device, param, size, &value[0], nullptr);
+    if (err != CL_SUCCESS) {
+      return false;
+    }
+    add_key_field(key, value);
+  }
+  return true;
+}
+
+// Target the devices a program is built for are given code for.
+struct device_group {
+  cl_uint address_bits;
+  uint32_t clc_version;
+  std::string options;
+  std::string translated;
+};
+
+static uint32_t clc_version_from_string(const char *str) {
+  unsigned major, minor;
+  if (sscanf(str, "%u.%u", &major, &minor) != 2) {
+    return 0;
+  }
+  uint32_t version = major * 100 + minor * 10;
+  if (version < 200) {
+    return 120;
+  } else if (version < 300) {
+    return 200;
+  }
+  return 300;
+}
+
+static bool device_clc_version(cl_device_id device, uint32_t &version) {
+  size_t size;
+  cl_int err =
+      clGetDeviceInfo(device, CL_DEVICE_OPENCL_C_VERSION, 0, nullptr, &size);
+  if (err != CL_SUCCESS) {
+    return false;
+  }
+  std::string value(size, '\0');
+  err = clGetDeviceInfo(device, CL_DEVICE_OPENCL_C_VERSION, size, &value[0],
+                        nullptr);
+  if ((err != CL_SUCCESS) || (value.compare(0, 9, "OpenCL C ") != 0)) {
+    return false;
+  }
+  version = clc_version_from_string(value.c_str() + 9);
+  return version != 0;
+}
+
+static std::string clc_std_option(uint32_t clc_version) {
+  return " -cl-std=CL" + std::to_string(clc_version / 100) + "." +
+         std::to_string(clc_version % 100 / 10) + " ";
+}
+
+// Runs the toolchain for the devices unless the result is in the cache.
+static bool translate_group(mock_program *program, cl_uint num_input_headers,
+                            const cl_program *input_headers,
+                            const char **header_include_names,
+                            device_group &group) {
+  std::string llvm_target;
+  switch (group.address_bits) {
+  case 32:
+    llvm_target = "spir";
+    break;
+  case 64:
+    llvm_target = "spir64";
+    break;
+  default:
+    return false;
+  }
+
+  std::string key;
+  add_key_field(key, program->src());
+  for (unsigned i = 0; i < num_input_headers; i++) {
+    auto hprog = reinterpret_cast<mock_program *>(input_headers[i]);
+    add_key_field(key, header_include_names[i]);
+    add_key_field(key, hprog->src());
+  }
+  add_key_field(key, group.options);
+  add_key_field(key, std::to_string(group.address_bits));
+  if (!gCacheDir.empty()) {
+    add_key_field(key, toolchain_id());
+  }
+
+  stage_timer io_timer{"File I/O", program};
+  if (cache_load(key, ".cl", group.translated)) {
+    log() << "Found translated program in cache" << std::endl;
+    return true;
+  }
+
+  // Store sources to scratch space
+  scratch_dir scratch;
+  if (!scratch.valid()) {
+    return false;
+  }
+  log() << "Created folder " << scratch.path().string() << std::endl;
+
+  std::filesystem::path src_file{scratch.path() / "original.cl"};
   if (!save_string_to_file(src_file, program->src())) {
-    return nullptr;
+    return false;
   }
 
   for (unsigned i = 0; i < num_input_headers; i++) {
-    std::filesystem::path header_file{tmp_folder / header_include_names[i]};
+    std::filesystem::path header_file{scratch.path() /
+                                      header_include_names[i]};
     std::filesystem::create_directories(header_file.parent_path());
     auto hprog = reinterpret_cast<mock_program *>(input_headers[i]);
     if (!save_string_to_file(header_file.string(), hprog->src())) {
-      return nullptr;
+      return false;
     }
   }
+  io_timer.stop();
+
+  // Translate to SPIR-V, piping the IR straight into llvm-spirv
+  std::string cmd_c_to_spv;
+  cmd_c_to_spv += CLANG;
+  cmd_c_to_spv += " -O0 -w -c ";
+  cmd_c_to_spv += " -target " + llvm_target;
+  cmd_c_to_spv += " -Xclang -no-opaque-pointers ";
+  cmd_c_to_spv += " -x cl " + group.options;
+  cmd_c_to_spv += " -Xclang -finclude-default-header -emit-llvm";
+  cmd_c_to_spv += " -o - " + src_file.string();
+  cmd_c_to_spv += " | " + LLVMSPIRV;
+  cmd_c_to_spv += " --spirv-max-version=1.0";
+  cmd_c_to_spv += " -o - -";
+  stage_timer frontend_timer{"Frontend and SPIR-V conversion", program};
+  std::string spv;
+  bool success = read_command_output(cmd_c_to_spv, spv);
+  frontend_timer.stop();
+  if (!success || spv.empty() || (spv.size() % sizeof(uint32_t) != 0)) {
+    log() << "Failed to compile OpenCL C to SPIR-V" << std::endl;
+    return false;
+  }
+
+  // Translate SPIR-V back to C
+  std::vector<uint32_t> binary(spv.size() / sizeof(uint32_t));
+  memcpy(binary.data(), spv.data(), spv.size());
 
-  int syserr;
+  spv_target_env env = SPV_ENV_OPENCL_1_2;
+  if (group.clc_version == 200) {
+    env = SPV_ENV_OPENCL_2_0;
+  }
+  stage_timer translate_timer{"Translation", program};
+  spirv2clc::translator translator(env, group.clc_version);
+  if (translator.translate(binary, &group.translated) != 0) {
+    log() << "Failed to translate SPIR-V to OpenCL C" << std::endl;
+    return false;
+  }
+  translate_timer.stop();
 
-  // Translate to SPIR-V
-  std::filesystem::path bitcode_file{tmp_folder / "original.bc"};
+  stage_timer store_timer{"File I/O", program};
+  cache_store(key, ".cl", group.translated);
+
+  return true;
+}
+
+// Produces the OpenCL C handed to the driver for a program. All devices are
+// given code for the lowest OpenCL C version among them. A single driver
+// program serves all devices so they must share an address size, the
+// translation depends on it.
+static bool translate_program(mock_program *program, cl_uint num_devices,
+                              const cl_device_id *device_list,
+                              const char *options, cl_uint num_input_headers,
+                              const cl_program *input_headers,
+                              const char **header_include_names,
+                              std::vector<cl_device_id> &devices,
+                              std::string &translated) {
+  auto clprog = reinterpret_cast<cl_program>(program);
   std::string soptions;
   if (options != nullptr) {
     soptions += options;
@@ -195,160 +661,369 @@ static cl_program compile(mock_program *program, cl_uint num_devices,
 
   cl_int err;
 
-  // Select device
-  // TODO support multiple devices
-  if (num_devices > 1) {
-    return nullptr;
-  }
-  cl_device_id device;
+  // Select devices
   if (device_list != nullptr) {
-    device = device_list[0];
+    devices.assign(device_list, device_list + num_devices);
   } else {
     cl_uint num_devices;
     err = clGetProgramInfo(clprog, CL_PROGRAM_NUM_DEVICES, sizeof(num_devices),
                            &num_devices, nullptr);
     if (err != CL_SUCCESS) {
-      return nullptr;
+      return false;
     }
-    printf("num_devices = %u\n", num_devices);
 
-    std::vector<cl_device_id> devices;
     devices.resize(num_devices);
 
     err = clGetProgramInfo(clprog, CL_PROGRAM_DEVICES,
                            devices.size() * sizeof(cl_device_id),
                            devices.data(), nullptr);
     if (err != CL_SUCCESS) {
-      return nullptr;
+      return false;
     }
-
-    device = devices[0];
-  }
-
-  // Choose target from device address size
-  cl_uint address_bits;
-  err = clGetDeviceInfo(device, CL_DEVICE_ADDRESS_BITS, sizeof(address_bits),
-                        &address_bits, nullptr);
-  if (err != CL_SUCCESS) {
-    return nullptr;
   }
-  std::string llvm_target;
-  switch (address_bits) {
-  case 32:
-    llvm_target = "spir";
-    break;
-  case 64:
-    llvm_target = "spir64";
-    break;
-  default:
-    return nullptr;
-  }
-  // Choose CL C version from device query if not specified
-  if (soptions.find("-cl-std=") == std::string::npos) {
-    // TODO pick version from query
-    soptions += " -cl-std=CL1.2 ";
-  }
-  std::string cmd_c_to_ir;
-  cmd_c_to_ir += CLANG;
-  cmd_c_to_ir += " -O0 -w -c ";
-  cmd_c_to_ir += " -target " + llvm_target;
-  cmd_c_to_ir += " -Xclang -no-opaque-pointers ";
-  cmd_c_to_ir +=
-      " -x cl " + soptions + " -Xclang -finclude-default-header -emit-llvm";
-  cmd_c_to_ir += " -o " + bitcode_file.string();
-  cmd_c_to_ir += " " + src_file.string();
-  syserr = std::system(cmd_c_to_ir.c_str());
-  if (syserr != 0) {
-    log() << "Failed to compile OpenCL C to IR" << std::endl;
-    return nullptr;
+  if (devices.empty()) {
+    return false;
   }
 
-  std::filesystem::path spv_file{tmp_folder / "original.spv"};
-  std::string cmd_ir_to_spv = LLVMSPIRV;
-  cmd_ir_to_spv += " --spirv-max-version=1.0";
-  cmd_ir_to_spv += " -o " + spv_file.string();
-  cmd_ir_to_spv += " " + bitcode_file.string();
-  syserr = std::system(cmd_ir_to_spv.c_str());
-  if (syserr != 0) {
-    log() << "Failed to translate IR to SPIR-V" << std::endl;
-    return nullptr;
+  // Choose CL C version from the options or the device query
+  uint32_t options_clc_version = 0;
+  auto std_pos = soptions.find("-cl-std=CL");
+  if (std_pos != std::string::npos) {
+    options_clc_version = clc_version_from_string(soptions.c_str() + std_pos +
+                                                  strlen("-cl-std=CL"));
+    if (options_clc_version == 0) {
+      return false;
+    }
   }
 
-  // Translate SPIR-V back to C
-  std::filesystem::path translated_source{tmp_folder / "translated.cl"};
-  std::string cmd_spv_to_c =
-      SPIRV2CLC + " " + spv_file.string() + " > " + translated_source.string();
-  syserr = std::system(cmd_spv_to_c.c_str());
-  if (syserr != 0) {
-    log() << "Failed to translate SPIR-V to OpenCL C" << std::endl;
-    return nullptr;
+  // OpenCL C 3.0 makes the 2.0 features the translator uses optional, 3.0
+  // devices are given 1.2 code
+  uint32_t clc_version = options_clc_version;
+  if (clc_version == 0) {
+    for (auto device : devices) {
+      uint32_t device_version;
+      if (!device_clc_version(device, device_version)) {
+        return false;
+      }
+      if (device_version == 300) {
+        device_version = 120;
+      }
+      if ((clc_version == 0) || (device_version < clc_version)) {
+        clc_version = device_version;
+      }
+    }
+    soptions += clc_std_option(clc_version);
+  } else if (clc_version == 300) {
+    clc_version = 120;
   }
 
-  // Read back translated source
-  std::string translated;
-  std::ifstream ftranslated{translated_source};
+  // Choose target from device address size
+  cl_uint address_bits = 0;
+  for (auto device : devices) {
+    cl_uint device_address_bits;
+    err = clGetDeviceInfo(device, CL_DEVICE_ADDRESS_BITS,
+                          sizeof(device_address_bits), &device_address_bits,
+                          nullptr);
+    if (err != CL_SUCCESS) {
+      return false;
+    }
+    if ((address_bits != 0) && (device_address_bits != address_bits)) {
+      log() << "Devices with different address sizes are not supported"
+            << std::endl;
+      return false;
+    }
+    address_bits = device_address_bits;
+  }
 
-  if (!ftranslated.is_open()) {
-    std::cerr << "Could not open " << translated_source << std::endl;
-    return nullptr;
+  device_group group{address_bits, clc_version, soptions, ""};
+  if (!translate_group(program, num_input_headers, input_headers,
+                       header_include_names, group)) {
+    return false;
   }
+  translated = group.translated;
+  program->set_build_options(soptions);
 
-  std::stringstream buffer;
-  buffer << ftranslated.rdbuf();
-  translated = buffer.str();
+  std::string key;
+  add_key_field(key, translated);
+  add_key_field(key, soptions);
+  program->set_cache_key(key);
 
-  // Create programs
+  return true;
+}
+
+static cl_program create_programs(mock_program *program,
+                                  const std::string &translated,
+                                  cl_uint num_input_headers = 0,
+                                  const cl_program *input_headers = nullptr) {
+  cl_int err;
   const char *csrc = translated.c_str();
-  clprog =
+  auto clprog =
       fnCreateProgramWithSource(program->context(), 1, &csrc, nullptr, &err);
   if (err != CL_SUCCESS) {
     return nullptr;
   }
-  gProgramMap[program] = clprog;
+  set_program(program, clprog);
 
   for (unsigned i = 0; i < num_input_headers; i++) {
     auto hprog = reinterpret_cast<mock_program *>(input_headers[i]);
     const char *src = hprog->src().c_str();
-    clprog =
+    auto hclprog =
         fnCreateProgramWithSource(program->context(), 1, &src, nullptr, &err);
     if (err != CL_SUCCESS) {
       return nullptr;
     }
-    gProgramMap[hprog] = clprog;
+    set_program(hprog, hclprog);
+  }
+
+  return clprog;
+}
+
+static cl_program compile(mock_program *program, cl_uint num_devices,
+                          const cl_device_id *device_list, const char *options,
+                          cl_uint num_input_headers = 0,
+                          const cl_program *input_headers = nullptr,
+                          const char **header_include_names = nullptr) {
+  std::vector<cl_device_id> devices;
+  std::string translated;
+  if (!translate_program(program, num_devices, device_list, options,
+                         num_input_headers, input_headers,
+                         header_include_names, devices, translated)) {
+    return nullptr;
+  }
+
+  return create_programs(program, translated, num_input_headers,
+                         input_headers);
+}
+
+// Creates the program from cached binaries if there is one for every device.
+static cl_program load_binaries(mock_program *program,
+                                const std::vector<cl_device_id> &devices) {
+  std::vector<std::string> binaries(devices.size());
+  for (size_t i = 0; i < devices.size(); i++) {
+    std::string key;
+    if (!device_cache_key(program, devices[i], key) ||
+        !cache_load(key, ".bin", binaries[i])) {
+      return nullptr;
+    }
   }
 
+  std::vector<size_t> lengths;
+  std::vector<const unsigned char *> ptrs;
+  for (auto &binary : binaries) {
+    lengths.push_back(binary.size());
+    ptrs.push_back(reinterpret_cast<const unsigned char *>(binary.data()));
+  }
+
+  cl_int err;
+  auto clprog = clCreateProgramWithBinary(
+      program->context(), static_cast<cl_uint>(devices.size()), devices.data(),
+      lengths.data(), ptrs.data(), nullptr, &err);
+  if (err != CL_SUCCESS) {
+    return nullptr;
+  }
+  log() << "Found program binaries in cache" << std::endl;
+  set_program(program, clprog);
+
   return clprog;
 }
 
+static void store_binaries(mock_program *program, cl_program clprog) {
+  cl_uint num_devices;
+  cl_int err = fnGetProgramInfo(clprog, CL_PROGRAM_NUM_DEVICES,
+                                sizeof(num_devices), &num_devices, nullptr);
+  if (err != CL_SUCCESS) {
+    return;
+  }
+
+  std::vector<cl_device_id> devices(num_devices);
+  std::vector<size_t> sizes(num_devices);
+  err = fnGetProgramInfo(clprog, CL_PROGRAM_DEVICES,
+                         devices.size() * sizeof(cl_device_id), devices.data(),
+                         nullptr);
+  if (err != CL_SUCCESS) {
+    return;
+  }
+  err = fnGetProgramInfo(clprog, CL_PROGRAM_BINARY_SIZES,
+                         sizes.size() * sizeof(size_t), sizes.data(), nullptr);
+  if (err != CL_SUCCESS) {
+    return;
+  }
+
+  std::vector<std::string> binaries(num_devices);
+  std::vector<unsigned char *> ptrs(num_devices);
+  for (cl_uint i = 0; i < num_devices; i++) {
+    binaries[i].resize(sizes[i]);
+    ptrs[i] = reinterpret_cast<unsigned char *>(&binaries[i][0]);
+  }
+  err = fnGetProgramInfo(clprog, CL_PROGRAM_BINARIES,
+                         ptrs.size() * sizeof(unsigned char *), ptrs.data(),
+                         nullptr);
+  if (err != CL_SUCCESS) {
+    return;
+  }
+
+  // Devices the program wasn't built for have no binary
+  for (cl_uint i = 0; i < num_devices; i++) {
+    std::string key;
+    if (!binaries[i].empty() && device_cache_key(program, devices[i], key)) {
+      cache_store(key, ".bin", binaries[i]);
+    }
+  }
+}
+
+// Runs builds in the background for applications that want to be notified on
+// completion.
+class worker_pool {
+public:
+  worker_pool(unsigned num_workers) : m_stop(false) {
+    for (unsigned i = 0; i < num_workers; i++) {
+      m_workers.emplace_back([this] { run(); });
+    }
+  }
+
+  // Completes the pending builds and stops the workers. Jobs submitted
+  // afterwards run on the calling thread.
+  void drain() {
+    {
+      std::lock_guard<std::mutex> lock(m_lock);
+      if (m_stop) {
+        return;
+      }
+      m_stop = true;
+    }
+    m_cv.notify_all();
+    for (auto &worker : m_workers) {
+      worker.join();
+    }
+  }
+
+  void submit(std::function<void()> &&job) {
+    {
+      std::lock_guard<std::mutex> lock(m_lock);
+      if (!m_stop) {
+        m_jobs.push(std::move(job));
+        m_cv.notify_one();
+        return;
+      }
+    }
+    job();
+  }
+
+private:
+  void run() {
+    for (;;) {
+      std::function<void()> job;
+      {
+        std::unique_lock<std::mutex> lock(m_lock);
+        m_cv.wait(lock, [this] { return m_stop || !m_jobs.empty(); });
+        if (m_jobs.empty()) {
+          return;
+        }
+        job = std::move(m_jobs.front());
+        m_jobs.pop();
+      }
+      job();
+    }
+  }
+
+  std::mutex m_lock;
+  std::condition_variable m_cv;
+  std::queue<std::function<void()>> m_jobs;
+  std::vector<std::thread> m_workers;
+  bool m_stop;
+};
+
+// The pool is created on first use and never destroyed. It is drained from an
+// exit handler instead: handlers registered once the driver is initialised
+// run before the driver's static objects are destroyed, so pending builds
+// complete while the driver is still usable.
+static worker_pool *gWorkers;
+static std::once_flag gWorkersOnce;
+
+static worker_pool &workers() {
+  std::call_once(gWorkersOnce, [] {
+    auto num_workers = std::max(1u, std::thread::hardware_concurrency());
+    gWorkers = new worker_pool{num_workers};
+    atexit([] { gWorkers->drain(); });
+  });
+  return *gWorkers;
+}
+
+static cl_int build(mock_program *prog, cl_uint num_devices,
+                    const cl_device_id *device_list, const char *options) {
+  // FIXME capture build log and store in wrapper
+  std::vector<cl_device_id> devices;
+  std::string translated;
+  cl_program program = nullptr;
+  bool from_binary = false;
+  if (translate_program(prog, num_devices, device_list, options, 0, nullptr,
+                        nullptr, devices, translated)) {
+    if (gCacheBinaries) {
+      stage_timer timer{"File I/O", prog};
+      program = load_binaries(prog, devices);
+      from_binary = program != nullptr;
+    }
+    if (program == nullptr) {
+      program = create_programs(prog, translated);
+    }
+  }
+  if (program == nullptr) {
+    prog->set_build_status(CL_BUILD_ERROR);
+    return CL_BUILD_PROGRAM_FAILURE;
+  }
+
+  stage_timer build_timer{"Driver build", prog};
+  prog->set_driver_build();
+  cl_int ret = fnBuildProgram(program, num_devices, device_list,
+                              prog->build_options().c_str(), nullptr, nullptr);
+  build_timer.stop();
+  prog->set_build_status(ret == CL_SUCCESS ? CL_BUILD_SUCCESS : CL_BUILD_ERROR);
+  if ((ret == CL_SUCCESS) && gCacheBinaries && !from_binary) {
+    stage_timer timer{"File I/O", prog};
+    store_binaries(prog, program);
+  }
+
+  return ret;
+}
+
 cl_int CL_API_CALL clBuildProgram(
     cl_program program, cl_uint num_devices, const cl_device_id *device_list,
     const char *options,
     void(CL_CALLBACK *pfn_notify)(cl_program program, void *user_data),
     void *user_data) {
 
-  cl_int ret = CL_BUILD_SUCCESS;
   auto prog = reinterpret_cast<mock_program *>(program);
-  if (gProgramMap.count(prog)) {
-    // FIXME capture build log and store in wrapper
-    auto program_sub = compile(prog, num_devices, device_list, options);
-    if (program_sub == nullptr) {
-      prog->set_build_status(CL_BUILD_ERROR);
-      ret = CL_BUILD_PROGRAM_FAILURE;
-    } else {
-      program = program_sub;
-    }
+  cl_program real;
+  if (!find_program(prog, &real)) {
+    return fnBuildProgram(program, num_devices, device_list, options,
+                          pfn_notify, user_data);
   }
 
-  if (ret == CL_BUILD_SUCCESS) {
-    ret = fnBuildProgram(program, num_devices, device_list, options, nullptr,
-                         nullptr);
+  if (!prog->begin_build()) {
+    return CL_INVALID_OPERATION;
   }
 
-  if (pfn_notify != nullptr) {
-    pfn_notify(program, user_data);
+  if (pfn_notify == nullptr) {
+    return build(prog, num_devices, device_list, options);
   }
 
-  return ret;
+  // Build in the background and notify the application on completion
+  std::vector<cl_device_id> devices;
+  if (device_list != nullptr) {
+    devices.assign(device_list, device_list + num_devices);
+  }
+  std::string soptions;
+  if (options != nullptr) {
+    soptions = options;
+  }
+
+  workers().submit([=, devices = std::move(devices)] {
+    build(prog, static_cast<cl_uint>(devices.size()),
+          devices.empty() ? nullptr : devices.data(), soptions.c_str());
+    pfn_notify(program, user_data);
+  });
+
+  return CL_SUCCESS;
 }
 
 cl_int clCompileProgram(
@@ -359,7 +1034,12 @@ cl_int clCompileProgram(
     void *user_data) {
   cl_int ret = CL_BUILD_SUCCESS;
   auto prog = reinterpret_cast<mock_program *>(program);
-  if (gProgramMap.count(prog)) {
+  cl_program real;
+  bool layer_program = find_program(prog, &real);
+  if (layer_program) {
+    if (!prog->begin_build()) {
+      return CL_INVALID_OPERATION;
+    }
     // FIXME capture build log and store in wrapper
     auto program_sub =
         compile(prog, num_devices, device_list, options, num_input_headers,
@@ -369,6 +1049,8 @@ cl_int clCompileProgram(
       ret = CL_BUILD_PROGRAM_FAILURE;
     } else {
       program = program_sub;
+      options = prog->build_options().c_str();
+      prog->set_driver_build();
     }
   }
 
@@ -376,12 +1058,19 @@ cl_int clCompileProgram(
     std::vector<cl_program> header_programs;
     for (unsigned i = 0; i < num_input_headers; i++) {
       auto hprog = reinterpret_cast<mock_program *>(input_headers[i]);
-      header_programs.push_back(gProgramMap.at(hprog));
+      cl_program hreal = nullptr;
+      find_program(hprog, &hreal);
+      header_programs.push_back(hreal);
     }
 
+    stage_timer timer{"Driver build", prog};
     ret = fnCompileProgram(program, num_devices, device_list, options,
                            num_input_headers, header_programs.data(),
                            header_include_names, nullptr, nullptr);
+    if (layer_program) {
+      prog->set_build_status(ret == CL_SUCCESS ? CL_BUILD_SUCCESS
+                                               : CL_BUILD_ERROR);
+    }
   }
 
   if (pfn_notify != nullptr) {
@@ -403,10 +1092,10 @@ cl_program clLinkProgram(cl_context context, cl_uint num_devices,
   std::vector<cl_program> input_progs;
   for (unsigned i = 0; i < num_input_programs; i++) {
     auto mock_input = reinterpret_cast<mock_program *>(input_programs[i]);
-    if (gProgramMap.count(mock_input) == 0) {
+    cl_program p;
+    if (!find_program(mock_input, &p)) {
       return nullptr;
     }
-    auto p = gProgramMap.at(mock_input);
     input_progs.push_back(p);
   }
   auto ret = fnLinkProgram(context, num_devices, device_list, options,
@@ -422,9 +1111,8 @@ cl_int CL_API_CALL clGetProgramInfo(cl_program program,
                                     size_t *param_value_size_ret) {
 
   auto prog = reinterpret_cast<mock_program *>(program);
-  if (gProgramMap.count(prog)) {
-    program = gProgramMap.at(prog);
-    if (program == nullptr) {
+  if (find_program(prog, &program)) {
+    if ((program == nullptr) || !prog->driver_build()) {
       cl_int ret = CL_SUCCESS;
       const void *copy_ptr;
       size_t size_ret;
@@ -495,9 +1183,8 @@ cl_int CL_API_CALL clGetProgramBuildInfo(
     cl_program program, cl_device_id device, cl_program_build_info param_name,
     size_t param_value_size, void *param_value, size_t *param_value_size_ret) {
   auto prog = reinterpret_cast<mock_program *>(program);
-  if (gProgramMap.count(prog)) {
-    program = gProgramMap.at(prog);
-    if (program == nullptr) {
+  if (find_program(prog, &program)) {
+    if ((program == nullptr) || !prog->driver_build()) {
       cl_int ret = CL_SUCCESS;
       const void *copy_ptr;
       size_t size_ret;
@@ -537,10 +1224,7 @@ cl_kernel CL_API_CALL clCreateKernel(cl_program program,
                                      const char *kernel_name,
                                      cl_int *errcode_ret) {
   auto prog = reinterpret_cast<mock_program *>(program);
-
-  if (gProgramMap.count(prog)) {
-    program = gProgramMap.at(prog);
-  }
+  find_program(prog, &program);
 
   return fnCreateKernel(program, kernel_name, errcode_ret);
 }
@@ -550,10 +1234,7 @@ cl_int CL_API_CALL clCreateKernelsInProgram(cl_program program,
                                             cl_kernel *kernels,
                                             cl_uint *num_kernels_ret) {
   auto prog = reinterpret_cast<mock_program *>(program);
-
-  if (gProgramMap.count(prog)) {
-    program = gProgramMap.at(prog);
-  }
+  find_program(prog, &program);
 
   return fnCreateKernelsInProgram(program, num_kernels, kernels,
                                   num_kernels_ret);
@@ -577,6 +1258,7 @@ cl_int clGetKernelInfo(cl_kernel kernel, cl_kernel_info param_name,
       *param_value_size_ret = sizeof(cl_program);
     }
 
+    std::shared_lock<std::shared_mutex> lock(gProgramMapLock);
     for (auto &mock_real : gProgramMap) {
       if (kprog == mock_real.second) {
         memcpy(param_value, &mock_real.first, sizeof(cl_program));
@@ -12,21 +12,154 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
 #include <cstring>
+#include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #include "spirv2clc.h"
 
 void fail_help(const char *prog) {
-  std::cerr << "Usage: " << prog << " [ --asm ] input.spv[asm]" << std::endl;
+  std::cerr << "Usage: " << prog
+            << " [ --asm ] [ --cl-std=CL1.2|CL2.0|CL3.0 ]"
+            << " [ --no-inline-conditions ]"
+            << " [ --promote-constant=kernel:arg[:size] ]..."
+            << " [ -o dir ] [ -j N ] input.spv[asm]..." << std::endl;
   exit(EXIT_FAILURE);
 }
 
+// Read-only mapping of a whole file
+class mapped_file {
+public:
+  mapped_file(const char *fname) : m_data(nullptr), m_size(0), m_valid(false) {
+#ifdef _WIN32
+    HANDLE file = CreateFileA(fname, GENERIC_READ, FILE_SHARE_READ, nullptr,
+                              OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+      return;
+    }
+    LARGE_INTEGER size;
+    if (GetFileSizeEx(file, &size)) {
+      m_size = static_cast<size_t>(size.QuadPart);
+      if (m_size == 0) {
+        m_valid = true;
+      } else {
+        HANDLE mapping =
+            CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (mapping != nullptr) {
+          m_data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+          m_valid = m_data != nullptr;
+          CloseHandle(mapping);
+        }
+      }
+    }
+    CloseHandle(file);
+#else
+    int fd = open(fname, O_RDONLY);
+    if (fd < 0) {
+      return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0) {
+      m_size = st.st_size;
+      if (m_size == 0) {
+        m_valid = true;
+      } else {
+        void *data = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+          m_data = data;
+          m_valid = true;
+        }
+      }
+    }
+    close(fd);
+#endif
+  }
+
+  ~mapped_file() {
+    if (m_data != nullptr) {
+#ifdef _WIN32
+      UnmapViewOfFile(m_data);
+#else
+      munmap(m_data, m_size);
+#endif
+    }
+  }
+
+  mapped_file(const mapped_file &) = delete;
+  mapped_file &operator=(const mapped_file &) = delete;
+
+  bool valid() const { return m_valid; }
+  const void *data() const { return m_data; }
+  size_t size() const { return m_size; }
+
+private:
+  void *m_data;
+  size_t m_size;
+  bool m_valid;
+};
+
+static bool translate_file(spirv2clc::translator &translator,
+                           const char *fname, bool input_asm,
+                           std::string *srcgen, std::string *error) {
+  mapped_file file(fname);
+
+  if (!file.valid()) {
+    *error = "Could not open " + std::string{fname};
+    return false;
+  }
+
+  int err;
+  if (input_asm) {
+    std::string assembly;
+    if (file.size() != 0) {
+      assembly.assign(static_cast<const char *>(file.data()), file.size());
+    }
+    err = translator.translate(assembly, srcgen);
+  } else {
+    // Mappings are page-aligned, the module is translated in place
+    err = translator.translate(static_cast<const uint32_t *>(file.data()),
+                               file.size() / sizeof(uint32_t), srcgen);
+  }
+
+  if (err != 0) {
+    *error = "Failed to translate " + std::string{fname};
+    return false;
+  }
+
+  return true;
+}
+
 int main(int argc, char *argv[]) {
 
   bool input_asm = false;
+  bool inline_conditions = true;
+  spv_target_env env = SPV_ENV_OPENCL_1_2;
+  uint32_t clc_version = 120;
+  std::vector<std::tuple<std::string, uint32_t, uint64_t>> promotions;
+
+  std::vector<const char *> inputs;
+  std::string output_dir;
+  unsigned num_jobs = 1;
 
   int arg = 1;
 
@@ -34,51 +167,192 @@ int main(int argc, char *argv[]) {
     fail_help(argv[0]);
   }
 
-  int num_options = 0;
   while (arg < argc) {
     if (!strcmp(argv[arg], "--asm")) {
       input_asm = true;
-      num_options++;
-    } else if (!strncmp(argv[arg], "--", 2)) {
+    } else if (!strcmp(argv[arg], "--no-inline-conditions")) {
+      inline_conditions = false;
+    } else if (!strncmp(argv[arg], "--cl-std=", 9)) {
+      const char *std = argv[arg] + 9;
+      if (!strcmp(std, "CL1.2")) {
+        env = SPV_ENV_OPENCL_1_2;
+        clc_version = 120;
+      } else if (!strcmp(std, "CL2.0")) {
+        env = SPV_ENV_OPENCL_2_0;
+        clc_version = 200;
+      } else if (!strcmp(std, "CL3.0")) {
+        env = SPV_ENV_OPENCL_2_2;
+        clc_version = 300;
+      } else {
+        std::cerr << "Unknown OpenCL C version '" << std << "'" << std::endl;
+        fail_help(argv[0]);
+      }
+    } else if (!strncmp(argv[arg], "--promote-constant=", 19)) {
+      std::string spec = argv[arg] + 19;
+      auto colon = spec.find(':');
+      if ((colon == std::string::npos) || (colon == 0)) {
+        std::cerr << "Invalid argument specification '" << spec << "'"
+                  << std::endl;
+        fail_help(argv[0]);
+      }
+      char *end;
+      auto index = strtoul(spec.c_str() + colon + 1, &end, 0);
+      uint64_t size = 0;
+      if (*end == ':') {
+        size = strtoull(end + 1, &end, 0);
+      }
+      if (*end != '\0') {
+        std::cerr << "Invalid argument specification '" << spec << "'"
+                  << std::endl;
+        fail_help(argv[0]);
+      }
+      promotions.emplace_back(spec.substr(0, colon), index, size);
+    } else if (!strcmp(argv[arg], "-o")) {
+      if (++arg == argc) {
+        fail_help(argv[0]);
+      }
+      output_dir = argv[arg];
+    } else if (!strncmp(argv[arg], "-j", 2)) {
+      const char *jobs = argv[arg] + 2;
+      if (*jobs == '\0') {
+        if (++arg == argc) {
+          fail_help(argv[0]);
+        }
+        jobs = argv[arg];
+      }
+      char *end;
+      num_jobs = strtoul(jobs, &end, 0);
+      if ((*end != '\0') || (end == jobs)) {
+        std::cerr << "Invalid number of jobs '" << jobs << "'" << std::endl;
+        fail_help(argv[0]);
+      }
+      if (num_jobs == 0) {
+        num_jobs = std::max(1u, std::thread::hardware_concurrency());
+      }
+    } else if (!strncmp(argv[arg], "-", 1)) {
       std::cerr << "Unknown option '" << argv[arg] << "'" << std::endl;
       fail_help(argv[0]);
+    } else {
+      inputs.push_back(argv[arg]);
     }
     arg++;
   }
 
-  if (argc < 2 + num_options) {
+  if (inputs.empty()) {
     fail_help(argv[0]);
   }
 
-  const char *fname = argv[argc - 1];
-  std::ifstream file(fname, std::ios::binary);
-
-  if (!file.is_open()) {
-    std::cerr << "Could not open " << fname << std::endl;
-    exit(EXIT_FAILURE);
+  if ((inputs.size() > 1) && output_dir.empty()) {
+    std::cerr << "Multiple inputs require an output directory" << std::endl;
+    fail_help(argv[0]);
   }
 
-  spirv2clc::translator translator;
-  std::string srcgen;
-  int err;
-  if (input_asm) {
-    std::stringstream buffer;
-    buffer << file.rdbuf();
+  // Outputs are named after the inputs, refuse to overwrite one output with
+  // another
+  std::vector<std::filesystem::path> outputs;
+  if (!output_dir.empty()) {
+    std::unordered_map<std::string, const char *> output_inputs;
+    for (auto fname : inputs) {
+      std::filesystem::path ofname{output_dir};
+      ofname /= std::filesystem::path{fname}.filename();
+      ofname.replace_extension(".cl");
+      auto key = ofname.lexically_normal().string();
+      auto it = output_inputs.emplace(key, fname);
+      if (!it.second) {
+        std::cerr << "Inputs " << it.first->second << " and " << fname
+                  << " would both be written to " << ofname.string()
+                  << std::endl;
+        exit(EXIT_FAILURE);
+      }
+      outputs.push_back(ofname);
+    }
 
-    err = translator.translate(buffer.str(), &srcgen);
-  } else {
-    file.seekg(0, std::ios::end);
-    uint32_t size = file.tellg();
-    file.seekg(0, std::ios::beg);
-    std::vector<uint32_t> binary(size / sizeof(uint32_t));
-    file.read(reinterpret_cast<char *>(binary.data()), size);
-    err = translator.translate(binary, &srcgen);
+    std::error_code ec;
+    std::filesystem::create_directories(output_dir, ec);
+    if (ec) {
+      std::cerr << "Could not create " << output_dir << std::endl;
+      exit(EXIT_FAILURE);
+    }
   }
 
-  printf("%s\n", srcgen.c_str());
+  // Inputs are handed out to the workers one at a time, each worker has its
+  // own translator. Failures are reported per file.
+  std::atomic<size_t> next_input{0};
+  std::atomic<unsigned> num_failures{0};
+  std::mutex report_lock;
 
-  if (err != 0) {
-    std::cerr << "Failed to translate module." << std::endl;
+  auto worker = [&]() {
+    spirv2clc::translator translator(env, clc_version);
+    translator.set_inline_conditions(inline_conditions);
+    for (auto &promotion : promotions) {
+      translator.promote_to_constant(std::get<0>(promotion),
+                                     std::get<1>(promotion),
+                                     std::get<2>(promotion));
+    }
+
+    size_t i;
+    while ((i = next_input++) < inputs.size()) {
+      const char *fname = inputs[i];
+      std::string srcgen, error;
+      bool success =
+          translate_file(translator, fname, input_asm, &srcgen, &error);
+
+      if (!output_dir.empty()) {
+        auto &ofname = outputs[i];
+        if (success) {
+          std::ofstream ofile{ofname};
+          ofile << srcgen << std::endl;
+          ofile.close();
+          if (!ofile.good()) {
+            error = "Could not write " + ofname.string();
+            success = false;
+          }
+        }
+        // Don't leave the output of a previous run behind
+        if (!success) {
+          std::error_code ec;
+          std::filesystem::remove(ofname, ec);
+        }
+      }
+
+      std::lock_guard<std::mutex> lock(report_lock);
+      if (output_dir.empty()) {
+        printf("%s\n", srcgen.c_str());
+      }
+
+      for (auto &kargs : translator.constant_args()) {
+        for (auto index : kargs.second) {
+          if (inputs.size() > 1) {
+            std::cerr << fname << ": ";
+          }
+          std::cerr << "Promoted argument " << index << " of kernel "
+                    << kargs.first << " to the constant address space"
+                    << std::endl;
+        }
+      }
+
+      if (!success) {
+        std::cerr << error << std::endl;
+        num_failures++;
+      }
+    }
+  };
+
+  std::vector<std::thread> workers;
+  auto num_workers = std::min<size_t>(num_jobs, inputs.size());
+  for (size_t i = 1; i < num_workers; i++) {
+    workers.emplace_back(worker);
+  }
+  worker();
+  for (auto &thread : workers) {
+    thread.join();
+  }
+
+  if (num_failures != 0) {
+    if (inputs.size() > 1) {
+      std::cerr << num_failures << " of " << inputs.size()
+                << " modules failed to translate" << std::endl;
+    }
     exit(EXIT_FAILURE);
   }
 